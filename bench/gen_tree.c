@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+
+// Synthetic source trees for benchmarking safe_cp, the content comes from a fixed seed so every run copies the same bytes
+#define BLOCK_SIZE (1024 * 1024)
+
+unsigned long long seed = 88172645463325252ULL;
+char block[BLOCK_SIZE];
+
+void fill_block(size_t length);
+bool make_dir(const char *path);
+bool write_file(const char *path, long long size);
+bool write_sparse_file(const char *path, long long size, int data_percent);
+bool gen_tiny(const char *root, int scale);
+bool gen_huge(const char *root, int scale);
+bool gen_sparse(const char *root, int scale);
+bool gen_deep(const char *root, int scale);
+bool gen_wide(const char *root, int scale);
+void show_help_msg();
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3 || argc > 4)
+    {
+        show_help_msg();
+        return EXIT_FAILURE;
+    }
+    const char *profile = argv[1];
+    const char *root = argv[2];
+    int scale = argc == 4 ? atoi(argv[3]) : 1;
+    if (scale < 1 || !make_dir(root))
+    {
+        show_help_msg();
+        return EXIT_FAILURE;
+    }
+
+    bool done;
+    if (!strcmp(profile, "tiny"))
+        done = gen_tiny(root, scale);
+    else if (!strcmp(profile, "huge"))
+        done = gen_huge(root, scale);
+    else if (!strcmp(profile, "sparse"))
+        done = gen_sparse(root, scale);
+    else if (!strcmp(profile, "deep"))
+        done = gen_deep(root, scale);
+    else if (!strcmp(profile, "wide"))
+        done = gen_wide(root, scale);
+    else
+    {
+        show_help_msg();
+        return EXIT_FAILURE;
+    }
+    return done ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// xorshift64, fast enough that generating doesn't dominate the setup. Only the first [length] bytes (rounded up to
+// whole words) are new, callers fill what they write
+void fill_block(size_t length)
+{
+    unsigned long long *words = (unsigned long long *)block;
+    for (size_t i = 0; i < (length + sizeof(unsigned long long) - 1) / sizeof(unsigned long long); i++)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        words[i] = seed;
+    }
+}
+
+bool make_dir(const char *path)
+{
+    if (mkdir(path, 0777) == -1 && errno != EEXIST)
+    {
+        perror("Failed to create directory");
+        return false;
+    }
+    return true;
+}
+
+bool write_file(const char *path, long long size)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        perror("Failed to create file");
+        return false;
+    }
+    while (size > 0)
+    {
+        size_t length = size < BLOCK_SIZE ? size : BLOCK_SIZE;
+        fill_block(length);
+        if (write(fd, block, length) != (ssize_t)length)
+        {
+            perror("Failed to write file");
+            close(fd);
+            return false;
+        }
+        size -= length;
+    }
+    close(fd);
+    return true;
+}
+
+// [data_percent] of the blocks hold data, spread evenly, the rest are holes
+bool write_sparse_file(const char *path, long long size, int data_percent)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, size) == -1)
+    {
+        perror("Failed to create sparse file");
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+    long long blocks = size / BLOCK_SIZE;
+    for (long long i = 0; i < blocks; i++)
+    {
+        if (i * data_percent / 100 == (i + 1) * data_percent / 100)
+            continue;
+        fill_block(BLOCK_SIZE);
+        if (pwrite(fd, block, BLOCK_SIZE, i * BLOCK_SIZE) != BLOCK_SIZE)
+        {
+            perror("Failed to write sparse file");
+            close(fd);
+            return false;
+        }
+    }
+    close(fd);
+    return true;
+}
+
+// 10000 files of 0-4 KB in 100 directories
+bool gen_tiny(const char *root, int scale)
+{
+    char path[4096];
+    for (int d = 0; d < 100 * scale; d++)
+    {
+        snprintf(path, sizeof(path), "%s/dir%d", root, d);
+        if (!make_dir(path))
+            return false;
+        for (int f = 0; f < 100; f++)
+        {
+            snprintf(path, sizeof(path), "%s/dir%d/file%d", root, d, f);
+            if (!write_file(path, (d * 100 + f) * 41 % 4097))
+                return false;
+        }
+    }
+    return true;
+}
+
+// 3 files of 1 GB
+bool gen_huge(const char *root, int scale)
+{
+    char path[4096];
+    for (int f = 0; f < 3; f++)
+    {
+        snprintf(path, sizeof(path), "%s/huge%d", root, f);
+        if (!write_file(path, (long long)scale * 1024 * BLOCK_SIZE))
+            return false;
+    }
+    return true;
+}
+
+// 4 files of 1 GB with 5% data
+bool gen_sparse(const char *root, int scale)
+{
+    char path[4096];
+    for (int f = 0; f < 4; f++)
+    {
+        snprintf(path, sizeof(path), "%s/sparse%d", root, f);
+        if (!write_sparse_file(path, (long long)scale * 1024 * BLOCK_SIZE, 5))
+            return false;
+    }
+    return true;
+}
+
+// a chain of 200 directories with 5 small files on each level, created through directory fds so
+// larger scales can go past PATH_MAX
+bool gen_deep(const char *root, int scale)
+{
+    int dir_fd = open(root, O_RDONLY | O_DIRECTORY);
+    bool done = dir_fd != -1;
+    char name[32];
+    for (int level = 0; done && level < 200 * scale; level++)
+    {
+        snprintf(name, sizeof(name), "lvl%d", level);
+        int child_fd = -1;
+        if ((mkdirat(dir_fd, name, 0777) == -1 && errno != EEXIST) || (child_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY)) == -1)
+        {
+            perror("Failed to create directory");
+            done = false;
+        }
+        close(dir_fd);
+        dir_fd = child_fd;
+        for (int f = 0; done && f < 5; f++)
+        {
+            snprintf(name, sizeof(name), "file%d", f);
+            int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            fill_block(1024 * (f + 1));
+            done = fd != -1 && write(fd, block, 1024 * (f + 1)) == 1024 * (f + 1);
+            if (!done)
+                perror("Failed to write file");
+            if (fd != -1)
+                close(fd);
+        }
+    }
+    if (dir_fd != -1)
+        close(dir_fd);
+    return done;
+}
+
+// one directory with 20000 small files
+bool gen_wide(const char *root, int scale)
+{
+    char path[4096];
+    for (int f = 0; f < 20000 * scale; f++)
+    {
+        snprintf(path, sizeof(path), "%s/entry%d", root, f);
+        if (!write_file(path, 512))
+            return false;
+    }
+    return true;
+}
+
+void show_help_msg()
+{
+    printf(
+        "Usage: gen_tree <profile> <directory> [scale]\n\n"
+        "Profiles:\n"
+        "  tiny    10000 files of 0-4 KB in 100 directories\n"
+        "  huge    3 files of 1 GB\n"
+        "  sparse  4 sparse files of 1 GB with 5%% data\n"
+        "  deep    200 nested directories with 5 small files each\n"
+        "  wide    one directory with 20000 files of 512 bytes\n\n"
+        "The scale multiplies the file counts (tiny, wide), sizes (huge, sparse) or depth (deep).\n");
+}
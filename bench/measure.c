@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// Runs a command and writes its wall time, CPU times, peak RSS and exit code as JSON fields for run_bench.sh, so the harness
+// doesn't depend on /usr/bin/time being installed
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        printf("Usage: measure <output_file> <command> [args...]\n");
+        return EXIT_FAILURE;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("Failed to fork");
+        return EXIT_FAILURE;
+    }
+    if (pid == 0)
+    {
+        execvp(argv[2], argv + 2);
+        perror("Failed to run command");
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1)
+    {
+        perror("Failed to wait for command");
+        return EXIT_FAILURE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    FILE *output = fopen(argv[1], "w");
+    if (output == NULL)
+    {
+        perror("Failed to open output file");
+        return EXIT_FAILURE;
+    }
+    fprintf(output,
+            "\"seconds\": %.6f, \"user_seconds\": %.6f, \"system_seconds\": %.6f, \"max_rss_kb\": %ld, \"exit_code\": %d",
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+            usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+            usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+            usage.ru_maxrss,
+            WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    fclose(output);
+    return EXIT_SUCCESS;
+}
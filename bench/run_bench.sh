@@ -0,0 +1,110 @@
+#!/bin/sh
+# Benchmarks safe_cp in its different modes against coreutils cp on synthetic trees.
+#
+# Usage: bench/run_bench.sh [profile...]      (default: tiny huge sparse deep wide)
+#
+# Environment:
+#   BENCH_DIR  where the trees and copies are made (default: /tmp/safe_cp_bench), needs ~8 GB at SCALE=1
+#   SCALE      size multiplier passed to gen_tree (default: 1)
+#   RUNS       runs of every mode and cache state (default: 1)
+#   OUTPUT     results file, one JSON object per run (default: bench_output.txt in the repository)
+#
+# Cold cache runs need root to write /proc/sys/vm/drop_caches, they are skipped otherwise.
+# Syscall counts come from a separate `strace -f -c` run and are null when strace isn't installed.
+
+set -u
+
+REPO=$(cd "$(dirname "$0")/.." && pwd)
+BENCH_DIR=${BENCH_DIR:-/tmp/safe_cp_bench}
+SCALE=${SCALE:-1}
+RUNS=${RUNS:-1}
+OUTPUT=${OUTPUT:-$REPO/bench_output.txt}
+PROFILES=${*:-tiny huge sparse deep wide}
+
+# name|arguments, safe_cp modes first, then cp
+MODES='default|
+read_write|--engine=read_write
+io_uring|--engine=io_uring
+jobs8|--jobs 8
+file_threads4|--file-threads=4
+no_reflink|--reflink=never
+direct256|--direct=256
+cp|'
+
+BIN="$BENCH_DIR/bin"
+mkdir -p "$BIN" || exit 1
+gcc -O2 -pthread "$REPO/safe-cp-v2.c" -o "$BIN/safe_cp" &&
+    gcc -O2 "$REPO/bench/gen_tree.c" -o "$BIN/gen_tree" &&
+    gcc -O2 "$REPO/bench/measure.c" -o "$BIN/measure" || exit 1
+
+CACHES=warm
+if [ -w /proc/sys/vm/drop_caches ]; then
+    CACHES="warm cold"
+else
+    echo "Can't drop the page cache (not root), only warm cache runs are measured."
+fi
+HAVE_STRACE=false
+command -v strace > /dev/null && HAVE_STRACE=true
+
+# cp copies into an existing directory the same way safe_cp -d does
+copy_command()
+{
+    if [ "$1" = cp ]; then
+        echo "cp -r $2"
+    else
+        echo "$BIN/safe_cp $3 -s $2 -d"
+    fi
+}
+
+prepare_cache()
+{
+    if [ "$1" = cold ]; then
+        sync
+        echo 3 > /proc/sys/vm/drop_caches
+    else
+        find "$2" -type f -exec cat {} + > /dev/null
+    fi
+}
+
+for profile in $PROFILES; do
+    source="$BENCH_DIR/src/$profile"
+    if [ ! -d "$source" ]; then
+        echo "Generating $profile tree..."
+        mkdir -p "$BENCH_DIR/src" && "$BIN/gen_tree" "$profile" "$source" "$SCALE" || exit 1
+    fi
+    files=$(find "$source" -type f | wc -l)
+    bytes=$(find "$source" -type f -printf '%s\n' | awk '{ total += $1 } END { printf "%d", total }')
+
+    echo "$MODES" | while IFS='|' read -r mode arguments; do
+        tool=safe_cp
+        [ "$mode" = cp ] && tool=cp
+        command=$(copy_command "$mode" "$source" "$arguments")
+        destination="$BENCH_DIR/dst"
+
+        syscalls=null
+        if $HAVE_STRACE; then
+            rm -rf "$destination" && mkdir -p "$destination"
+            strace -f -c -o "$BENCH_DIR/strace.txt" $command "$destination" < /dev/null > /dev/null 2>&1
+            syscalls=$(awk '$NF == "total" { print $4 }' "$BENCH_DIR/strace.txt")
+            [ -n "$syscalls" ] || syscalls=null
+        fi
+
+        for cache in $CACHES; do
+            run=1
+            while [ "$run" -le "$RUNS" ]; do
+                rm -rf "$destination" && mkdir -p "$destination"
+                prepare_cache "$cache" "$source"
+                "$BIN/measure" "$BENCH_DIR/measure.txt" $command "$destination" < /dev/null > /dev/null 2>&1
+                measured=$(cat "$BENCH_DIR/measure.txt")
+                seconds=$(echo "$measured" | sed 's/.*"seconds": \([0-9.]*\).*/\1/')
+                rates=$(awk -v b="$bytes" -v f="$files" -v s="$seconds" \
+                    'BEGIN { if (s <= 0) s = 1e-6; printf "\"mb_per_s\": %.2f, \"files_per_s\": %.1f", b / s / 1048576, f / s }')
+                printf '{"profile": "%s", "scale": %s, "tool": "%s", "mode": "%s", "arguments": "%s", "cache": "%s", "run": %s, "files": %s, "bytes": %s, %s, %s, "syscalls": %s}\n' \
+                    "$profile" "$SCALE" "$tool" "$mode" "$arguments" "$cache" "$run" "$files" "$bytes" "$measured" "$rates" "$syscalls" |
+                    tee -a "$OUTPUT"
+                run=$((run + 1))
+            done
+        done
+    done
+    rm -rf "$BENCH_DIR/dst"
+done
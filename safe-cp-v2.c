@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // copy_file_range, splice
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,24 +9,587 @@
 #include <dirent.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <sys/resource.h>
+#include <sys/xattr.h>
+#include <time.h>
 
 #define NL printf("\n\n")
+#define SMALL_COPY_SIZE (64 * 1024)       // files up to this size are copied through a stack buffer
+#define MIN_BUFFER_SIZE (128 * 1024)
+#define MAX_BUFFER_SIZE (64 * 1024 * 1024)
+#define BUFFER_ALIGNMENT 4096
+#define URING_DEPTH 8 // read->write pairs in flight per file
+#define DIRENT_BATCH_SIZE (128 * 1024)
+#define OPEN_DIRS_DEFAULT 256 // lowered to a quarter of RLIMIT_NOFILE
+#define OPEN_DIRS_MIN 8
+#define PATH_BUFFER_SLACK 256 // grow path buffers past the first long path so the next ones fit
+#define NO_PARENT ((unsigned)-1)
+#define LATENCY_BUCKETS 24 // powers of two up to 8 s
+#define SLOWEST_FILES 10
+#define PROGRESS_TTY_INTERVAL 500    // ms
+#define PROGRESS_LINE_INTERVAL 10000 // ms
+// XXH64
+#define HASH_PRIME_1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME_3 0x165667B19E3779F9ULL
+#define HASH_PRIME_4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME_5 0x27D4EB2F165667C5ULL
+#define DEDUP_SAMPLE_SIZE 4096
+#define DEDUP_MAX_CANDIDATES 8
+#define DURABLE_MAX_FILESYSTEMS 16 // past this, --durable falls back to sync()
+#define TEMPORARY_NAME_SIZE 64
 enum source_type
 {
     F, // FILE  is used by lang in /usr/include/stdio.h it's [typedef struct _IO_FILE FILE;]
     D, // Directory
+    L, // symbolic link, recreated as a link
     NOT_EXIST
 };
-void copy_file(const char *source_path, const char *destination_path, const char *file_name, bool enable_overwrite);
+// How file data is moved, each engine falls back to the next one when the kernel or filesystem doesn't support it
+enum copy_engine
+{
+    ENGINE_REFLINK,         // share extents with the source (btrfs, XFS, ...), no data is copied
+    ENGINE_DIRECT,          // O_DIRECT reads and writes that bypass the page cache, for huge files
+    ENGINE_CHUNKED,         // ranges of one large file copied by several threads at once
+    ENGINE_COPY_FILE_RANGE, // in-kernel copy, may be offloaded to the filesystem
+    ENGINE_SENDFILE,        // in-kernel copy through the page cache
+    ENGINE_SPLICE,          // in-kernel copy through a pipe
+    ENGINE_IO_URING,        // several reads and writes in flight at once
+    ENGINE_READ_WRITE,      // userspace buffer loop
+    ENGINE_COUNT
+};
+enum copy_result
+{
+    COPY_DONE,
+    COPY_UNSUPPORTED, // nothing was copied, try the next engine
+    COPY_FAILED
+};
+enum reflink_mode
+{
+    REFLINK_AUTO,   // clone when the filesystem can, copy otherwise
+    REFLINK_ALWAYS, // fail instead of copying
+    REFLINK_NEVER
+};
+enum sparse_mode
+{
+    SPARSE_AUTO, // copy only the data extents of files that have holes
+    SPARSE_NEVER
+};
+const char *engine_names[ENGINE_COUNT] = {"reflink", "direct", "chunked", "copy_file_range", "sendfile", "splice", "io_uring", "read_write"};
+enum copy_engine first_engine = ENGINE_COPY_FILE_RANGE; // --engine=
+enum reflink_mode reflink_mode = REFLINK_AUTO;          // --reflink=
+enum sparse_mode sparse_mode = SPARSE_AUTO;             // --sparse=
+bool preallocate = true;                                // --no-preallocate
+off_t direct_threshold = 0;                             // --direct=, 0: never
+int file_threads = 1;                                   // --file-threads=
+off_t chunk_size = 64 * 1024 * 1024;                    // --chunk-size=
+enum update_mode
+{
+    UPDATE_NONE,
+    UPDATE_TIME, // skip destination files of the same size that aren't older than the source
+    UPDATE_HASH  // skip destination files with the same content
+};
+enum update_mode update_mode = UPDATE_NONE; // --update
+enum conflict_policy
+{
+    CONFLICT_ASK, // prompt, the default on a terminal
+    CONFLICT_OVERWRITE,
+    CONFLICT_SKIP, // the default when stdin isn't a terminal
+    CONFLICT_NEWER, // overwrite files older than the source
+    CONFLICT_RENAME, // copy under the first free "name.N.ext"
+    CONFLICT_FAIL    // stop copying at the first conflict
+};
+enum conflict_decision
+{
+    DECISION_WRITE, // overwrite the file, or merge into the directory
+    DECISION_RENAME,
+    DECISION_SKIP
+};
+enum conflict_policy conflict_policy = CONFLICT_ASK; // --on-conflict=
+bool conflict_stop = false;                         // set by --on-conflict=fail
+struct hash_state
+{
+    unsigned long long accumulators[4];
+    unsigned long long length;
+    unsigned char buffer[32]; // partial stripe
+    size_t buffered;
+};
+bool verify = false;                // --verify
+FILE *checksum_file = NULL;         // --checksums
+size_t checksum_root_length;        // the destination prefix left out of checksum file paths
+char *checksum_prefix = NULL;       // leads from the checksum file's directory to the destination, "" inside it
+pthread_mutex_t checksum_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned long verify_failures = 0;
+__thread struct hash_state *copy_hash = NULL; // set while a copy hashes its data in flight
+
+// Hard links: the first name of an inode with more than one link is copied, later names are linked to it.
+// Open addressing on (device, inode), only files with st_nlink > 1 are added
+bool preserve_links = true; // --no-hard-links
+// --preserve: attributes are copied through the open fds, an attribute the destination can't take is dropped
+enum preserve_attribute
+{
+    PRESERVE_MODE = 1,
+    PRESERVE_TIMESTAMPS = 2,
+    PRESERVE_OWNERSHIP = 4,
+    PRESERVE_XATTR = 8,
+    PRESERVE_ALL = 15
+};
+int preserve_attributes = 0; // --preserve=
+// Symbolic links in the sources are recreated as links, --symlinks=follow copies what they point to instead
+enum symlink_mode
+{
+    SYMLINKS_COPY,
+    SYMLINKS_FOLLOW,
+    SYMLINKS_COMMAND_LINE // follow the sources given with -s, recreate the links inside them
+};
+enum symlink_mode symlink_mode = SYMLINKS_COPY; // --symlinks=
+struct link_entry
+{
+    dev_t device;
+    ino_t inode;
+    struct dir_handle *dir; // destination directory of the first name, retained. NULL when its copy failed
+    char *name;
+    bool used;
+    bool pending; // the first name isn't copied (or with --durable=file published) yet, later names wait for it
+};
+struct link_table
+{
+    struct link_entry *entries;
+    size_t capacity, count;
+    pthread_mutex_t lock;
+    pthread_cond_t finished; // a pending first name was copied or failed
+} link_table = {.lock = PTHREAD_MUTEX_INITIALIZER, .finished = PTHREAD_COND_INITIALIZER};
+
+// --dedup: every copied file is indexed by size and a hash of sampled blocks, a later file with the same content
+// (found with full hashes, checked byte by byte) shares the data of the first copy
+enum dedup_mode
+{
+    DEDUP_NONE,
+    DEDUP_REFLINK, // clone the earlier copy, the files stay independent
+    DEDUP_HARDLINK
+};
+enum dedup_mode dedup_mode = DEDUP_NONE; // --dedup
+const char *dedup_off_reason = NULL;     // why --dedup turned itself off, printed at exit instead of no savings
+struct fingerprint
+{
+    unsigned long long sample_hash, full_hash;
+    bool sampled, has_full_hash;
+};
+struct dedup_entry
+{
+    off_t size;
+    unsigned long long sample_hash, full_hash; // full_hash is computed when a candidate first needs it
+    bool has_full_hash;
+    struct dir_handle *dir; // destination directory of the copy, retained
+    char *name;
+};
+struct dedup_table
+{
+    struct dedup_entry *entries; // in copy order, never removed
+    size_t count, capacity;
+    size_t *slots; // open addressing on (size, sample_hash), entry index + 1, 0 is free
+    size_t slot_capacity;
+    pthread_mutex_t lock;
+} dedup_table = {.lock = PTHREAD_MUTEX_INITIALIZER};
+struct
+{
+    unsigned long long files, bytes;
+} dedup_savings;
+enum durable_mode
+{
+    DURABLE_NONE,
+    DURABLE_BATCH, // syncfs() each destination filesystem once, at the end
+    DURABLE_FILE   // also fsync each file before giving it its name
+};
+enum durable_mode durable_mode = DURABLE_NONE; // --durable=
+bool anonymous_files = true;                   // --durable=file writes O_TMPFILEs, until the filesystem can't
+struct
+{
+    dev_t devices[DURABLE_MAX_FILESYSTEMS];
+    int fds[DURABLE_MAX_FILESYSTEMS];
+    int count;
+    bool everything; // too many filesystems to track
+    pthread_mutex_t lock;
+} synced_filesystems = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// --stats: counters and timers of the hot paths, updated with relaxed atomics so --jobs threads can share them
+enum stats_mode
+{
+    STATS_NONE,
+    STATS_TEXT,
+    STATS_JSON
+};
+enum stats_phase
+{
+    PHASE_STAT,   // fstatat of sources and destinations, statx of entries without d_type
+    PHASE_SCAN,   // opening directories and getdents64
+    PHASE_OPEN,   // opening source and destination files, creating symbolic links
+    PHASE_COPY,   // moving the data of each file
+    PHASE_MKDIR,  // creating destination directories
+    PHASE_PROMPT, // waiting for overwrite/rename answers
+    PHASE_SYNC,   // --durable fsync and syncfs
+    PHASE_COUNT
+};
+const char *phase_names[PHASE_COUNT] = {"stat", "scan", "open", "copy", "mkdir", "prompt", "sync"};
+enum stats_mode stats_mode = STATS_NONE; // --stats
+struct slow_file
+{
+    unsigned long long nanoseconds;
+    char *path;
+};
+struct stats
+{
+    unsigned long long calls[PHASE_COUNT];
+    unsigned long long nanoseconds[PHASE_COUNT];
+    unsigned long long files, failed_files, skipped_files, unchanged_files, linked_files, symlinks, directories, bytes;
+    unsigned long long engines[ENGINE_COUNT];
+    unsigned long long latency[LATENCY_BUCKETS]; // files per open-to-close time
+    struct slow_file slowest[SLOWEST_FILES];     // slowest first
+    pthread_mutex_t slowest_lock;
+} stats = {.slowest_lock = PTHREAD_MUTEX_INITIALIZER};
+
+// --progress: the copy loops only add to the counters, a reporter thread turns them into a status line
+enum progress_mode
+{
+    PROGRESS_NONE,
+    PROGRESS_TTY,  // one line redrawn in place
+    PROGRESS_LINES // a new line every PROGRESS_LINE_INTERVAL, for logs
+};
+enum progress_mode progress_mode = PROGRESS_NONE; // --progress
+struct progress
+{
+    off_t bytes, total_bytes;
+    long files, total_files;
+    bool stopping;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t stopped;
+} progress = {.lock = PTHREAD_MUTEX_INITIALIZER};
+const char *clear_line = ""; // erases a drawn progress line before other output
+
+// --file-threads: threads take the next range of the file until none is left
+struct chunked_copy
+{
+    int source_file;
+    int destination_file;
+    off_t size;
+    off_t next_offset;
+    bool failed;
+};
+
+// Copy buffers are kept after use and handed to the next file instead of a malloc/free per file
+struct copy_buffer
+{
+    char *data;
+    size_t size;
+    struct copy_buffer *next;
+};
+struct buffer_pool
+{
+    struct copy_buffer *free_buffers;
+    size_t allocated; // bytes of all buffers, free or in use
+    size_t budget;    // --buffer-memory=
+    pthread_mutex_t lock;
+} buffer_pool = {NULL, 0, 256 * 1024 * 1024, PTHREAD_MUTEX_INITIALIZER};
+
+// One ring per thread, set up on first use and shared by every file that thread copies
+struct uring
+{
+    int fd;
+    char *sq_ring, *cq_ring;
+    size_t sq_size, cq_size;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_count;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+__thread struct uring uring = {.fd = -1};
+__thread bool uring_unavailable = false;
+
+// An open directory shared by the entries copied out of (or into) it: syscalls use its fd with the entry name,
+// so the kernel never walks full paths. [path] is kept for messages, the fd is closed with the last reference
+struct dir_handle
+{
+    int fd; // -1 while the open directory budget has it closed
+    char *path; // stored right after the handle, in the same allocation. Reopening uses it relative to an open parent
+    size_t path_length;
+    struct dir_handle *parent; // NULL for top-level directories
+    int references;
+    int users;                         // steps using the fd right now, it's only closed while this is 0
+    bool restore_metadata;             // --preserve: set mode and times when the last reference is released
+    mode_t mode;
+    struct timespec times[2];
+    dev_t device; // --symlinks=follow: the source directory, to find link cycles
+    ino_t inode;
+    struct dir_handle *older, *newer; // open handles, by last use
+};
+struct dir_handle cwd_handle = {.fd = AT_FDCWD, .references = 1}; // top-level sources are opened by their full path
+
+// Directories whose entries are still being copied keep a handle. Past the limit the least recently used idle ones
+// are closed and reopened through their parent when a later step needs them
+struct
+{
+    struct dir_handle *newest, *oldest;
+    int open, limit;
+    unsigned long long reopened;
+    pthread_mutex_t lock;
+} dir_budget = {.limit = OPEN_DIRS_DEFAULT, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Paths are only built for messages. Each thread builds them in buffers that only grow, and reuses one getdents64
+// buffer per directory depth, so copying an entry doesn't allocate
+struct path_buffer
+{
+    char *data;
+    size_t capacity;
+};
+__thread struct path_buffer source_path_buffer, destination_path_buffer;
+struct scan_buffers
+{
+    char **buffers; // buffers[depth] is used by the directory being scanned at that depth
+    int count, depth;
+};
+__thread struct scan_buffers scan_buffers;
+
+// Reads a directory in large getdents64 batches instead of readdir's small ones
+struct dir_scanner
+{
+    int fd;
+    char *buffer;
+    long length;   // bytes filled by the last getdents64
+    long position; // next entry in the buffer
+};
+
+// --plan: every source is scanned before copying, entries only keep an offset into one shared names buffer
+// and the index of their parent, so a full path can be rebuilt without storing it
+struct manifest_entry
+{
+    unsigned parent; // NO_PARENT for the sources themselves
+    unsigned name;   // offset in manifest.names
+    enum source_type type;
+    off_t size;
+    dev_t device;
+    ino_t inode;
+};
+struct manifest_link
+{
+    dev_t device;
+    ino_t inode;
+    off_t needed_bytes;
+};
+struct plan_step
+{
+    struct dir_handle *parent; // retained
+    unsigned index;            // the directory's manifest entry
+};
+struct manifest
+{
+    struct manifest_entry *entries;
+    size_t count, capacity;
+    char *names;
+    size_t names_length, names_capacity;
+    size_t file_count, directory_count;
+    off_t total_bytes;
+    off_t needed_bytes;          // holes of sparse files and later names of hard links excluded
+    size_t linked_count;         // later names of hard links, linked instead of written
+    size_t errors;               // entries that couldn't be scanned, the totals are incomplete
+    struct manifest_link *links; // files with more than one link, sorted once the scan is done
+    size_t link_count, link_capacity;
+    struct plan_step *steps; // directories waiting to be scanned, depth first like the copy
+    size_t step_count, step_capacity;
+} manifest;
+enum plan_mode
+{
+    PLAN_NONE,
+    PLAN_CHECK, // --plan: scan, check the destination, then copy
+    PLAN_ONLY   // --plan-only: scan and check only
+};
+
+// --jobs: directories and files become tasks run by a work-stealing pool of threads
+struct task
+{
+    enum source_type type;
+    struct dir_handle *source_dir;
+    char *source_name;
+    struct dir_handle *destination_dir;
+    char *name; // the names are stored after the task, name shares source_name's copy when they're equal
+    bool enable_overwrite_check;
+};
+struct task_deque
+{
+    pthread_mutex_t lock;
+    struct task **tasks;
+    size_t capacity;
+    size_t top, bottom; // tasks[top..bottom) modulo capacity
+};
+struct thread_pool
+{
+    int size; // 1: no workers, copy serially
+    int deque_count;
+    struct task_deque *deques;
+    pthread_t *threads;
+    int next_deque; // round robin for tasks queued by the main thread
+    long pending;   // queued or running tasks
+    long queued;
+    bool stopping;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work_available;
+    pthread_cond_t all_done;
+} thread_pool = {.size = 1, .idle_lock = PTHREAD_MUTEX_INITIALIZER, .work_available = PTHREAD_COND_INITIALIZER, .all_done = PTHREAD_COND_INITIALIZER};
+// without workers, directories wait on this stack instead of being copied recursively
+struct
+{
+    struct task **tasks;
+    size_t count, capacity;
+    bool draining;
+} serial_tasks;
+__thread int worker_index = -1; // -1: main thread
+// parallel copies ask their overwrite/rename questions one at a time
+pthread_mutex_t prompt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void copy_file(struct dir_handle *source_dir, const char *source_name, struct dir_handle *destination_dir, const char *file_name, bool enable_overwrite);
 enum source_type get_source_type(const char *path);
-void copy_directory(const char *source_dir, const char *destination_dir, const char *dir_name, bool enable_overwrite);
+enum source_type get_source_type_at(int dir_fd, const char *name);
+enum source_type get_link_type_at(int dir_fd, const char *name);
+void copy_directory(struct dir_handle *source_parent, const char *source_name, struct dir_handle *destination_dir, const char *dir_name, bool enable_overwrite);
+void copy_symlink(struct dir_handle *source_dir, const char *source_name, struct dir_handle *destination_dir, const char *link_name, bool enable_overwrite);
+struct dir_handle *open_dir_handle(struct dir_handle *parent, const char *name, const char *path);
+struct dir_handle *retain_dir_handle(struct dir_handle *handle);
+void release_dir_handle(struct dir_handle *handle);
+bool use_dir_handle(struct dir_handle *handle);
+void unuse_dir_handle(struct dir_handle *handle);
+void close_idle_dirs(int keep);
+void link_newest_dir(struct dir_handle *handle);
+void unlink_dir(struct dir_handle *handle);
+char *build_path(struct path_buffer *buffer, const struct dir_handle *dir, const char *name);
+char *acquire_scan_buffer();
+void release_scan_buffer();
+void free_thread_buffers();
+struct dirent64 *next_dir_entry(struct dir_scanner *scanner);
+enum source_type get_entry_type(int dir_fd, const struct dirent64 *entry);
 // /path/to/anything/ => /path/to/anything
 void remove_last_slash(char **path);
 void decode_source_path(const char *path, char **name, char **true_path);
-void read_string(char *buffer, size_t buffer_size);
+char *resolve_source_path(const char *path);
+bool read_string(char *buffer, size_t buffer_size);
 char read_char();
 bool make_dir(const char *path);
+bool make_dir_at(int dir_fd, const char *name);
 bool create_directories_recursively(const char *path);
+bool parse_engine(const char *name);
+bool parse_reflink_mode(const char *name);
+bool parse_conflict_policy(const char *name);
+enum conflict_decision resolve_conflict(int destination_dir_fd, const char *destination_name, const char *destination_path, enum source_type source_type, enum source_type destination_type, const struct stat *source_state, char *new_name, size_t new_name_size);
+bool reserve_unique_name(int dir_fd, const char *name, bool directory, mode_t mode, char *new_name, size_t new_name_size);
+void stop_asking();
+void skip_file(off_t size, bool unchanged);
+enum copy_engine copy_data(int source_file, int destination_file, const struct stat *source_state, bool *sparse_copy);
+enum copy_engine copy_range(int source_file, int destination_file, off_t limit, off_t size);
+enum copy_engine check_copied_size(int source_file, int destination_file, const struct stat *source_state, enum copy_engine engine);
+enum copy_result copy_sparse(int source_file, int destination_file, const struct stat *source_state, enum copy_engine *engine);
+enum copy_result copy_with_reflink(int source_file, int destination_file);
+bool preallocate_range(int destination_file, off_t offset, off_t length);
+enum copy_result copy_with_direct(int source_file, int destination_file, off_t size);
+bool set_direct_io(int fd, bool enable);
+enum copy_result copy_with_chunks(int source_file, int destination_file, off_t size);
+void *copy_chunks(void *arg);
+bool copy_chunk(int source_file, int destination_file, off_t offset, off_t end, struct copy_buffer **buffer);
+enum copy_result copy_with_copy_file_range(int source_file, int destination_file, off_t limit, off_t size);
+enum copy_result copy_with_sendfile(int source_file, int destination_file, off_t limit, off_t size);
+enum copy_result copy_with_splice(int source_file, int destination_file, off_t limit, off_t size);
+enum copy_result copy_with_io_uring(int source_file, int destination_file, off_t limit, off_t size);
+enum copy_result copy_with_read_write(int source_file, int destination_file, off_t limit, off_t size);
+bool setup_io_uring();
+void close_io_uring();
+void queue_io_uring(int opcode, int fd, char *buffer, unsigned length, off_t offset, unsigned long long user_data, bool link);
+bool wait_io_uring(unsigned outstanding);
+struct copy_buffer *acquire_buffer(off_t file_size);
+void release_buffer(struct copy_buffer *buffer);
+void free_buffer_pool();
+void copy_entry(enum source_type type, struct dir_handle *source_dir, const char *source_name, struct dir_handle *destination_dir, const char *name, bool enable_overwrite_check);
+void start_thread_pool(int jobs);
+void stop_thread_pool(int started);
+void submit_task(struct task *task);
+struct task *take_task(int index);
+void *worker_main(void *arg);
+void run_task(struct task *task);
+void push_serial_task(struct task *task);
+bool is_unsupported_error(int error);
+size_t next_chunk(off_t limit, off_t copied, size_t max_chunk);
+void plan_source(const char *path);
+void plan_entry(struct dir_handle *dir, const char *name, unsigned parent);
+void plan_directory(struct dir_handle *parent, unsigned index);
+void count_linked_names();
+int compare_manifest_links(const void *a, const void *b);
+bool check_plan(const char *destination);
+void free_manifest();
+void format_size(off_t bytes, char *buffer);
+unsigned long long start_timer();
+unsigned long long stop_timer(enum stats_phase phase, unsigned long long start);
+void record_file(const char *path, enum copy_engine engine, off_t bytes, unsigned long long start);
+void print_stats(unsigned long long elapsed);
+void print_json_string(const char *text);
+void free_stats();
+void add_progress(off_t bytes);
+bool is_unchanged(int source_dir_fd, const char *source_name, int destination_dir_fd, const char *destination_name, off_t *size);
+bool hash_file(int fd, off_t size, unsigned long long *hash);
+unsigned long long hash_round(unsigned long long accumulator, unsigned long long input);
+unsigned long long hash_merge(unsigned long long hash, unsigned long long accumulator);
+unsigned long long read_u64(const unsigned char *data);
+void hash_init(struct hash_state *state);
+void hash_update(struct hash_state *state, const void *input, size_t length);
+unsigned long long hash_final(const struct hash_state *state);
+void hash_zeros(off_t length);
+void write_checksum(const char *destination_path, unsigned long long hash);
+char *relative_prefix(const char *from, const char *to);
+bool check_checksums(const char *path);
+bool hash_file_at(int dir_fd, const char *name, off_t size, unsigned long long *hash);
+bool verify_copy(int destination_dir_fd, const char *destination_name, const char *destination_path, off_t size, unsigned long long source_hash);
+bool link_to_first_copy(const struct stat *source_state, struct dir_handle *destination_dir, const char *destination_name, const char *destination_path, bool *first_name);
+bool replace_with_link(struct dir_handle *target_dir, const char *target_name, int dir_fd, const char *name);
+bool find_or_add_link(dev_t device, ino_t inode, struct dir_handle *dir, const char *name, struct dir_handle **first_dir, char **first_name);
+struct link_entry *find_link_entry(dev_t device, ino_t inode);
+void finish_link(dev_t device, ino_t inode, bool copied);
+size_t link_index(dev_t device, ino_t inode);
+void grow_link_table();
+void free_link_table();
+enum dedup_mode deduplicate(int source_file, const struct stat *source_state, int destination_dir_fd, const char *destination_name, int destination_file, const char *destination_path, struct fingerprint *fingerprint);
+void stop_dedup(const char *reason);
+bool same_data(int file, int other_file, off_t size);
+bool sample_hash(int source_file, off_t size, struct fingerprint *fingerprint);
+void add_dedup_entry(off_t size, const struct fingerprint *fingerprint, struct dir_handle *dir, const char *name);
+void insert_dedup_slot(size_t index);
+size_t dedup_slot(off_t size, unsigned long long sample_hash);
+void free_dedup_table();
+bool parse_durable_mode(const char *name);
+int open_destination_file(int dir_fd, const char *name, mode_t mode, bool truncate, char *temporary_name);
+bool publish_file(int fd, int dir_fd, const char *name, char *temporary_name);
+bool copy_to_temporary_name(int fd, int dir_fd, const char *name, const char *temporary_name);
+void discard_file(int dir_fd, char *temporary_name);
+void make_temporary_name(char *buffer);
+void track_filesystem(int dir_fd);
+bool sync_filesystems();
+bool parse_preserve_attributes(const char *list);
+void preserve_metadata(int source_fd, const struct stat *source_state, int destination_fd, const char *destination_path, struct dir_handle *destination_dir);
+void copy_xattrs(int source_fd, int destination_fd, const char *destination_path);
+void restore_dir_metadata(struct dir_handle *handle);
+void drop_preserved(int attribute, const char *message);
+bool parse_symlink_mode(const char *name);
+bool follow_links(bool command_line);
+struct dir_handle *find_directory_cycle(struct dir_handle *source);
+void start_progress();
+void stop_progress();
+void *progress_main(void *arg);
+void print_progress(double elapsed, double rate, bool final);
 void show_help_msg();
 int main(int argc, char *argv[])
 {
@@ -39,6 +603,14 @@ int main(int argc, char *argv[])
     char **sources = NULL;
     char *destination = NULL;
     int source_count = 0;
+    int jobs = 1;
+    enum plan_mode plan_mode = PLAN_NONE;
+    char *checksum_path = NULL;
+    bool write_checksums = false;
+    const char *check_path = NULL;
+    bool conflict_policy_set = false;
+    bool open_dirs_set = false;
+    bool invalid_option = false;
 
     for (int i = 1; i < argc; i++)
     {
@@ -76,9 +648,210 @@ int main(int argc, char *argv[])
                 free(tmp);
             }
         }
+        else if (!strncmp(argv[i], "--engine=", 9))
+        {
+            if (!parse_engine(argv[i] + 9))
+            {
+                printf("Unknown copy engine %s.\n\n", argv[i] + 9);
+                invalid_option = true;
+            }
+        }
+        else if (!strncmp(argv[i], "--sparse=", 9))
+        {
+            if (!strcmp(argv[i] + 9, "auto"))
+                sparse_mode = SPARSE_AUTO;
+            else if (!strcmp(argv[i] + 9, "never"))
+                sparse_mode = SPARSE_NEVER;
+            else
+            {
+                printf("Unknown sparse mode %s.\n\n", argv[i] + 9);
+                invalid_option = true;
+            }
+        }
+        else if (!strncmp(argv[i], "--direct=", 9))
+        {
+            long megabytes = strtol(argv[i] + 9, NULL, 10);
+            if (megabytes <= 0)
+            {
+                printf("Invalid direct I/O threshold %s.\n\n", argv[i] + 9);
+                invalid_option = true;
+            }
+            else
+                direct_threshold = (off_t)megabytes * 1024 * 1024;
+        }
+        else if (!strncmp(argv[i], "--file-threads=", 15))
+        {
+            file_threads = strtol(argv[i] + 15, NULL, 10);
+            if (file_threads < 1)
+            {
+                printf("Invalid number of file threads %s.\n\n", argv[i] + 15);
+                invalid_option = true;
+            }
+        }
+        else if (!strncmp(argv[i], "--open-dirs=", 12))
+        {
+            dir_budget.limit = strtol(argv[i] + 12, NULL, 10);
+            open_dirs_set = true;
+            if (dir_budget.limit < 2)
+            {
+                printf("Invalid number of open directories %s.\n\n", argv[i] + 12);
+                invalid_option = true;
+            }
+        }
+        else if (!strncmp(argv[i], "--chunk-size=", 13))
+        {
+            long megabytes = strtol(argv[i] + 13, NULL, 10);
+            if (megabytes <= 0)
+            {
+                printf("Invalid chunk size %s.\n\n", argv[i] + 13);
+                invalid_option = true;
+            }
+            else
+                chunk_size = (off_t)megabytes * 1024 * 1024;
+        }
+        else if (!strcmp(argv[i], "--stats"))
+            stats_mode = STATS_TEXT;
+        else if (!strncmp(argv[i], "--stats=", 8))
+        {
+            if (!strcmp(argv[i] + 8, "json"))
+                stats_mode = STATS_JSON;
+            else
+            {
+                printf("Unknown stats format %s.\n\n", argv[i] + 8);
+                invalid_option = true;
+            }
+        }
+        else if (!strcmp(argv[i], "--progress"))
+            progress_mode = isatty(STDERR_FILENO) ? PROGRESS_TTY : PROGRESS_LINES;
+        else if (!strcmp(argv[i], "--progress=lines"))
+            progress_mode = PROGRESS_LINES;
+        else if (!strcmp(argv[i], "--update"))
+            update_mode = UPDATE_TIME;
+        else if (!strncmp(argv[i], "--update=", 9))
+        {
+            if (!strcmp(argv[i] + 9, "hash"))
+                update_mode = UPDATE_HASH;
+            else
+            {
+                printf("Unknown update mode %s.\n\n", argv[i] + 9);
+                invalid_option = true;
+            }
+        }
+        else if (!strcmp(argv[i], "--verify"))
+            verify = true;
+        else if (!strcmp(argv[i], "--checksums") || !strncmp(argv[i], "--checksums=", 12))
+        {
+            write_checksums = true;
+            free(checksum_path);
+            checksum_path = argv[i][11] == '=' ? strdup(argv[i] + 12) : NULL;
+        }
+        else if (!strncmp(argv[i], "--check=", 8))
+            check_path = argv[i] + 8;
+        else if (!strcmp(argv[i], "--dedup") || !strcmp(argv[i], "--dedup=reflink"))
+            dedup_mode = DEDUP_REFLINK;
+        else if (!strcmp(argv[i], "--dedup=hardlink"))
+            dedup_mode = DEDUP_HARDLINK;
+        else if (!strncmp(argv[i], "--dedup=", 8))
+        {
+            printf("Unknown dedup mode %s.\n\n", argv[i] + 8);
+            invalid_option = true;
+        }
+        else if (!strcmp(argv[i], "--preserve"))
+            preserve_attributes = PRESERVE_ALL;
+        else if (!strncmp(argv[i], "--preserve=", 11))
+        {
+            if (!parse_preserve_attributes(argv[i] + 11))
+            {
+                printf("Unknown attribute in --preserve=%s.\n\n", argv[i] + 11);
+                invalid_option = true;
+            }
+        }
+        else if (!strncmp(argv[i], "--symlinks=", 11))
+        {
+            if (!parse_symlink_mode(argv[i] + 11))
+            {
+                printf("Unknown symlink mode %s.\n\n", argv[i] + 11);
+                invalid_option = true;
+            }
+        }
+        else if (!strcmp(argv[i], "--no-hard-links"))
+            preserve_links = false;
+        else if (!strcmp(argv[i], "--no-preallocate"))
+            preallocate = false;
+        else if (!strcmp(argv[i], "--plan"))
+            plan_mode = PLAN_CHECK;
+        else if (!strcmp(argv[i], "--plan-only"))
+            plan_mode = PLAN_ONLY;
+        else if (!strcmp(argv[i], "--jobs") || !strncmp(argv[i], "--jobs=", 7))
+        {
+            const char *value = argv[i][6] == '=' ? argv[i] + 7 : (i + 1 < argc ? argv[++i] : "");
+            jobs = strtol(value, NULL, 10);
+            if (jobs < 1)
+            {
+                printf("Invalid number of jobs %s.\n\n", value);
+                invalid_option = true;
+            }
+        }
+        else if (!strncmp(argv[i], "--buffer-memory=", 16))
+        {
+            long megabytes = strtol(argv[i] + 16, NULL, 10);
+            if (megabytes <= 0)
+            {
+                printf("Invalid buffer memory %s.\n\n", argv[i] + 16);
+                invalid_option = true;
+            }
+            else
+                buffer_pool.budget = (size_t)megabytes * 1024 * 1024;
+        }
+        else if (!strcmp(argv[i], "--durable"))
+            durable_mode = DURABLE_BATCH;
+        else if (!strncmp(argv[i], "--durable=", 10))
+        {
+            if (!parse_durable_mode(argv[i] + 10))
+            {
+                printf("Unknown durability mode %s.\n\n", argv[i] + 10);
+                invalid_option = true;
+            }
+        }
+        else if (!strncmp(argv[i], "--on-conflict=", 14))
+        {
+            if (!parse_conflict_policy(argv[i] + 14))
+            {
+                printf("Unknown conflict policy %s.\n\n", argv[i] + 14);
+                invalid_option = true;
+            }
+            conflict_policy_set = true;
+        }
+        else if (!strncmp(argv[i], "--reflink=", 10))
+        {
+            if (!parse_reflink_mode(argv[i] + 10))
+            {
+                printf("Unknown reflink mode %s.\n\n", argv[i] + 10);
+                invalid_option = true;
+            }
+        }
+    }
+
+    // hashed copies read the data through the read()/write() loop, they're never clones
+    if (reflink_mode == REFLINK_ALWAYS && (verify || write_checksums) && check_path == NULL)
+    {
+        printf("--reflink=always can't be combined with --verify or --checksums, which copy the data to hash it.\n\n");
+        invalid_option = true;
+    }
+
+    // --check audits an earlier copy, nothing is copied
+    if (check_path != NULL && !invalid_option)
+    {
+        bool passed = check_checksums(check_path);
+        for (int j = 0; j < source_count; j++)
+            free(sources[j]);
+        free(sources);
+        free(destination);
+        free(checksum_path);
+        exit(passed ? EXIT_SUCCESS : EXIT_FAILURE);
     }
 
-    if (destination == NULL || sources == NULL)
+    if (destination == NULL || sources == NULL || invalid_option)
     {
         show_help_msg();
         if (sources)
@@ -89,22 +862,127 @@ int main(int argc, char *argv[])
         }
         if (destination)
             free(destination);
+        free(checksum_path);
+        exit(EXIT_FAILURE);
+    }
+
+    // the plan scan opens directories through the same budget as the copy
+    struct rlimit file_limit;
+    if (!open_dirs_set && getrlimit(RLIMIT_NOFILE, &file_limit) == 0 && file_limit.rlim_cur != RLIM_INFINITY && file_limit.rlim_cur / 4 < OPEN_DIRS_DEFAULT)
+        dir_budget.limit = file_limit.rlim_cur / 4 > OPEN_DIRS_MIN ? file_limit.rlim_cur / 4 : OPEN_DIRS_MIN;
+
+    unsigned long long run_start = start_timer();
+    // --progress needs the totals of the plan scan
+    if (plan_mode != PLAN_NONE || progress_mode != PROGRESS_NONE)
+    {
+        char *name;
+        char *source_path;
+        for (int i = 0; i < source_count; i++)
+        {
+            decode_source_path(sources[i], &name, &source_path);
+            plan_source(source_path);
+            free(name);
+            free(source_path);
+        }
+        count_linked_names();
+        progress.total_bytes = manifest.needed_bytes;
+        progress.total_files = manifest.file_count;
+        bool fits = plan_mode == PLAN_NONE || check_plan(destination);
+        // without --plan the copy goes on, its own errors name the entries
+        if (plan_mode == PLAN_NONE && manifest.errors > 0)
+            printf("Progress totals are incomplete: %zu %s couldn't be scanned.\n\n", manifest.errors, manifest.errors == 1 ? "entry" : "entries");
+        free_manifest();
+        if (!fits || plan_mode == PLAN_ONLY)
+        {
+            for (int j = 0; j < source_count; j++)
+                free(sources[j]);
+            free(sources);
+            free(destination);
+            exit(fits ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    // in use by the main thread until the end
+    struct dir_handle *destination_dir = open_dir_handle(&cwd_handle, destination, destination);
+    if (destination_dir == NULL)
+    {
+        perror("Failed to open destination directory");
+        for (int j = 0; j < source_count; j++)
+            free(sources[j]);
+        free(sources);
+        free(destination);
         exit(EXIT_FAILURE);
     }
 
+    if (write_checksums)
+    {
+        if (checksum_path == NULL)
+        {
+            checksum_path = malloc(strlen(destination) + sizeof("/checksums.xxh64"));
+            sprintf(checksum_path, "%s/checksums.xxh64", destination);
+        }
+        checksum_file = fopen(checksum_path, "w");
+        if (checksum_file == NULL)
+        {
+            perror("Failed to create checksum file");
+            unuse_dir_handle(destination_dir);
+            release_dir_handle(destination_dir);
+            for (int j = 0; j < source_count; j++)
+                free(sources[j]);
+            free(sources);
+            free(destination);
+            free(checksum_path);
+            exit(EXIT_FAILURE);
+        }
+        checksum_root_length = strlen(destination) + 1;
+        // --check resolves the paths against the checksum file's directory
+        char *checksum_directory = strdup(checksum_path);
+        char *slash = strrchr(checksum_directory, '/');
+        if (slash)
+            *(slash == checksum_directory ? slash + 1 : slash) = '\0';
+        char *resolved = realpath(slash ? checksum_directory : ".", NULL);
+        checksum_prefix = resolved ? relative_prefix(resolved, destination) : strdup("");
+        free(resolved);
+        free(checksum_directory);
+    }
+
+    if (durable_mode != DURABLE_NONE)
+    {
+        // the destination's own entry is in its parent, possibly created by -d
+        int parent_fd = openat(destination_dir->fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        track_filesystem(destination_dir->fd);
+        if (parent_fd != -1)
+        {
+            track_filesystem(parent_fd);
+            close(parent_fd);
+        }
+    }
+
+    // --update replaces changed files without asking, unless --on-conflict says otherwise
+    if (!conflict_policy_set && update_mode != UPDATE_NONE)
+        conflict_policy = CONFLICT_OVERWRITE;
+    // nobody is there to answer, a prompt would block the copy forever
+    else if (!conflict_policy_set && !isatty(STDIN_FILENO))
+        conflict_policy = CONFLICT_SKIP;
+
     enum source_type src_type = NOT_EXIST;
     char *name;
     char *source_path;
+    if (jobs > 1)
+        start_thread_pool(jobs);
+    // messages go to stdout, it only has a progress line to erase when it's a terminal too
+    if (progress_mode == PROGRESS_TTY && isatty(STDOUT_FILENO))
+        clear_line = "\033[K";
+    if (progress_mode != PROGRESS_NONE)
+        start_progress();
 
     for (int i = 0; i < source_count; i++)
     {
         decode_source_path(sources[i], &name, &source_path);
-        printf("Processing source: %s\n", source_path);
-        src_type = get_source_type(source_path);
-        if (src_type == F)
-            copy_file(source_path, destination, name, true);
-        else if (src_type == D)
-            copy_directory(source_path, destination, name, true);
+        printf("%sProcessing source: %s\n", clear_line, source_path);
+        src_type = follow_links(true) ? get_source_type(source_path) : get_link_type_at(AT_FDCWD, source_path);
+        if (src_type != NOT_EXIST)
+            copy_entry(src_type, &cwd_handle, source_path, destination_dir, name, true);
         else
             printf("Can't find Source %s . Skipping.\n\n", source_path);
         free(sources[i]);
@@ -112,16 +990,61 @@ int main(int argc, char *argv[])
         free(source_path);
     }
 
+    if (thread_pool.size > 1)
+        stop_thread_pool(jobs);
+    free_link_table();
+    free_dedup_table();
+    unuse_dir_handle(destination_dir);
+    release_dir_handle(destination_dir);
+    bool synced = true;
+    if (durable_mode != DURABLE_NONE)
+    {
+        if (checksum_file)
+            fflush(checksum_file);
+        synced = sync_filesystems();
+    }
+    stop_progress();
+    if (stats_mode != STATS_NONE)
+        print_stats(start_timer() - run_start);
+    if (checksum_file)
+    {
+        fclose(checksum_file);
+        printf("Checksums written to %s\n", checksum_path);
+    }
+    // a --dedup that turned itself off says why instead of reporting no savings
+    if (dedup_off_reason)
+        printf("%s\n", dedup_off_reason);
+    if (dedup_savings.files > 0 || (dedup_table.count > 0 && !dedup_off_reason))
+    {
+        char saved[32];
+        format_size(dedup_savings.bytes, saved);
+        printf("Deduplicated %llu files, %s not written.\n", dedup_savings.files, saved);
+    }
+    free(checksum_path);
+    free(checksum_prefix);
     free(sources);
     free(destination);
-    return 0;
+    close_io_uring();
+    free_buffer_pool();
+    free_stats();
+    free_thread_buffers();
+    free(serial_tasks.tasks);
+    return verify_failures > 0 || conflict_stop || !synced ? EXIT_FAILURE : 0;
 }
 
 enum source_type get_source_type(const char *path)
+{
+    return get_source_type_at(AT_FDCWD, path);
+}
+
+enum source_type get_source_type_at(int dir_fd, const char *name)
 {
     struct stat source_state;
     enum source_type type = NOT_EXIST;
-    if (stat(path, &source_state) != 0)
+    unsigned long long timer = start_timer();
+    int result = fstatat(dir_fd, name, &source_state, 0);
+    stop_timer(PHASE_STAT, timer);
+    if (result != 0)
         return type;
     if (S_ISREG(source_state.st_mode))
         type = F;
@@ -130,39 +1053,84 @@ enum source_type get_source_type(const char *path)
     return type;
 }
 
-void copy_file(const char *source_path, const char *destination_path, const char *file_name, bool enable_overwrite_check)
+// Like get_source_type_at(), but a symbolic link is L instead of what it points to
+enum source_type get_link_type_at(int dir_fd, const char *name)
 {
-    // full path = destination_path/file_name\0
-    char *full_destination_path = malloc(strlen(destination_path) + strlen(file_name) + 2);
-    sprintf(full_destination_path, "%s/%s", destination_path, file_name);
+    struct stat state;
+    unsigned long long timer = start_timer();
+    int result = fstatat(dir_fd, name, &state, AT_SYMLINK_NOFOLLOW);
+    stop_timer(PHASE_STAT, timer);
+    if (result != 0)
+        return NOT_EXIST;
+    if (S_ISLNK(state.st_mode))
+        return L;
+    return S_ISREG(state.st_mode) ? F : S_ISDIR(state.st_mode) ? D : NOT_EXIST;
+}
+
+void copy_file(struct dir_handle *source_dir, const char *source_name, struct dir_handle *destination_dir, const char *file_name, bool enable_overwrite_check)
+{
+    // paths are only built for messages, syscalls go through the directory fds
+    char *source_path = build_path(&source_path_buffer, source_dir, source_name);
+    char *full_destination_path = build_path(&destination_path_buffer, destination_dir, file_name);
+
+    off_t unchanged_size;
+    if (update_mode != UPDATE_NONE && is_unchanged(source_dir->fd, source_name, destination_dir->fd, file_name, &unchanged_size))
+    {
+        printf("%sUnchanged %s => %s, skipping.\n", clear_line, source_path, full_destination_path);
+        unsigned long long hash;
+        // keep the checksum file complete, the destination is the only copy that's read
+        if (checksum_file && hash_file_at(destination_dir->fd, file_name, unchanged_size, &hash))
+            write_checksum(full_destination_path, hash);
+        skip_file(unchanged_size, true);
+        return;
+    }
 
     // open return [file descriptor] is a number for file in proccess
-    int source_file = open(source_path, O_RDONLY);
+    unsigned long long file_start = start_timer();
+    unsigned long long timer = file_start;
+    int source_file = openat(source_dir->fd, source_name, O_RDONLY);
+    stop_timer(PHASE_OPEN, timer);
     if (source_file == -1)
     {
         perror("Failed to open source file");
-        free(full_destination_path);
+        record_file(source_path, ENGINE_COUNT, 0, file_start);
         return;
     }
-    enum source_type dest_type = get_source_type(full_destination_path);
+    const char *destination_name = file_name;
+    enum source_type dest_type = get_source_type_at(destination_dir->fd, destination_name);
     struct stat source_state;
-    stat(source_path, &source_state);
+    fstat(source_file, &source_state);
     char new_name[256];
 
-    while (dest_type == D)
+    bool overwrite = false;
+    bool prompting = (dest_type == D || (dest_type == F && enable_overwrite_check)) && __atomic_load_n(&conflict_policy, __ATOMIC_RELAXED) == CONFLICT_ASK;
+    timer = start_timer();
+    if (prompting)
+        pthread_mutex_lock(&prompt_lock);
+    // another prompt may have run out of input while this one waited for the lock
+    while (prompting && dest_type == D && __atomic_load_n(&conflict_policy, __ATOMIC_RELAXED) == CONFLICT_ASK)
     {
         printf("Destination %s is a directory.\nCannot overwrite a directory with a file.\nEnter new name for %s: ", full_destination_path, source_path);
-        read_string(new_name, sizeof(new_name));
+        if (!read_string(new_name, sizeof(new_name)))
+        {
+            stop_asking();
+            break;
+        }
         NL;
-        full_destination_path = realloc(full_destination_path, strlen(destination_path) + strlen(new_name) + 2);
-        sprintf(full_destination_path, "%s/%s", destination_path, new_name);
-        dest_type = get_source_type(full_destination_path);
+        destination_name = new_name;
+        full_destination_path = build_path(&destination_path_buffer, destination_dir, new_name);
+        dest_type = get_source_type_at(destination_dir->fd, new_name);
     }
-    while (dest_type == F && enable_overwrite_check)
+    while (prompting && dest_type == F && enable_overwrite_check && __atomic_load_n(&conflict_policy, __ATOMIC_RELAXED) == CONFLICT_ASK)
     {
         printf("Destination %s already exists.\nDo you want to overwrite it by %s ? (y/n): ", full_destination_path, source_path);
         char response = read_char();
         NL;
+        if (feof(stdin))
+        {
+            stop_asking();
+            break;
+        }
 
         if (response != 'y' && response != 'n')
         {
@@ -172,277 +1140,3416 @@ void copy_file(const char *source_path, const char *destination_path, const char
         if (response == 'n')
         {
             printf("Enter new name for %s: ", source_path);
-            read_string(new_name, sizeof(new_name));
+            if (!read_string(new_name, sizeof(new_name)))
+            {
+                stop_asking();
+                break;
+            }
             NL;
-            full_destination_path = realloc(full_destination_path, strlen(destination_path) + strlen(new_name) + 2);
-            sprintf(full_destination_path, "%s/%s", destination_path, new_name);
+            destination_name = new_name;
+            full_destination_path = build_path(&destination_path_buffer, destination_dir, new_name);
         }
         else
+        {
+            overwrite = true;
             break;
+        }
 
-        dest_type = get_source_type(full_destination_path);
+        dest_type = get_source_type_at(destination_dir->fd, destination_name);
+    }
+    if (prompting)
+    {
+        pthread_mutex_unlock(&prompt_lock);
+        // the file's latency doesn't include the time spent answering
+        file_start += stop_timer(PHASE_PROMPT, timer);
+    }
+    char unique_name[256];
+    if (dest_type == D || (dest_type == F && enable_overwrite_check && !overwrite))
+    {
+        enum conflict_decision decision = resolve_conflict(destination_dir->fd, destination_name, full_destination_path, F, dest_type, &source_state, unique_name, sizeof(unique_name));
+        if (decision == DECISION_SKIP)
+        {
+            skip_file(source_state.st_size, false);
+            close(source_file);
+            return;
+        }
+        if (decision == DECISION_RENAME)
+        {
+            destination_name = unique_name;
+            full_destination_path = build_path(&destination_path_buffer, destination_dir, unique_name);
+        }
     }
-    int destination_file = open(full_destination_path, O_WRONLY | O_CREAT | O_TRUNC, source_state.st_mode);
+    // an existing destination may be a link to a file already written in this run, it's only truncated once it's
+    // known that its data gets copied
+    bool hard_linked = preserve_links && source_state.st_nlink > 1;
+    // a followed symbolic link isn't one of the names of its target
+    struct stat link_state;
+    if (hard_linked && symlink_mode != SYMLINKS_COPY)
+        hard_linked = fstatat(source_dir->fd, source_name, &link_state, AT_SYMLINK_NOFOLLOW) == 0 && !S_ISLNK(link_state.st_mode);
+    bool delay_truncate = hard_linked || __atomic_load_n(&dedup_mode, __ATOMIC_RELAXED) != DEDUP_NONE;
+    char temporary_name[TEMPORARY_NAME_SIZE];
+    timer = start_timer();
+    int destination_file = open_destination_file(destination_dir->fd, destination_name, source_state.st_mode, !delay_truncate, temporary_name);
+    stop_timer(PHASE_OPEN, timer);
     if (destination_file == -1)
     {
         perror("Failed to open/create destination file");
+        record_file(source_path, ENGINE_COUNT, 0, file_start);
         close(source_file);
-        free(full_destination_path);
         return;
     }
-    int buffer_size = 100 * 1024 * 1024; // 100 MB
-    char *buffer = NULL;
-    while (!(buffer = malloc(buffer_size)) && buffer_size > 4096)
-        buffer_size /= 2;
-    if (buffer == NULL)
+    // linked names aren't written to --checksums, the first name covers the data. The first name has to tell later
+    // names whether it was copied, at every return below
+    bool first_name = false;
+    if (hard_linked && link_to_first_copy(&source_state, destination_dir, destination_name, full_destination_path, &first_name))
     {
-        printf("Failed to allocate memory for file copy buffer.\n");
+        discard_file(destination_dir->fd, temporary_name);
         close(source_file);
         close(destination_file);
-        free(full_destination_path);
         return;
     }
-    ssize_t bytes;
-    while ((bytes = read(source_file, buffer, buffer_size)) > 0)
+    struct fingerprint fingerprint = {0};
+    enum dedup_mode shared_by = DEDUP_NONE;
+    if (__atomic_load_n(&dedup_mode, __ATOMIC_RELAXED) != DEDUP_NONE && source_state.st_size > 0)
+        shared_by = deduplicate(source_file, &source_state, destination_dir->fd, destination_name, destination_file, full_destination_path, &fingerprint);
+    if (shared_by != DEDUP_NONE)
     {
-        if (write(destination_file, buffer, bytes) != bytes)
-        {
-            perror("Failed to write to destination file");
-            break;
-        }
+        // a clone is in the file opened above, a hard link replaced its name
+        if (shared_by == DEDUP_REFLINK && __atomic_load_n(&preserve_attributes, __ATOMIC_RELAXED))
+            preserve_metadata(source_file, &source_state, destination_file, full_destination_path, NULL);
+        bool published = shared_by == DEDUP_HARDLINK || durable_mode != DURABLE_FILE || publish_file(destination_file, destination_dir->fd, destination_name, temporary_name);
+        discard_file(destination_dir->fd, temporary_name);
+        if (first_name)
+            finish_link(source_state.st_dev, source_state.st_ino, published);
+        if (checksum_file)
+            write_checksum(full_destination_path, fingerprint.full_hash);
+        close(source_file);
+        close(destination_file);
+        return;
     }
-
-    if (bytes == -1)
+    if (delay_truncate && ftruncate(destination_file, 0) == -1)
     {
-        perror("Failed to read from source file");
+        perror("Failed to truncate destination file");
+        record_file(source_path, ENGINE_COUNT, 0, file_start);
+        discard_file(destination_dir->fd, temporary_name);
+        if (first_name)
+            finish_link(source_state.st_dev, source_state.st_ino, false);
+        close(source_file);
+        close(destination_file);
+        return;
+    }
+    bool sparse_copy;
+    // --verify and --checksums hash the data on its way through the read()/write() loop
+    struct hash_state hash;
+    bool hashing = verify || checksum_file;
+    if (hashing)
+    {
+        hash_init(&hash);
+        copy_hash = &hash;
     }
+    timer = start_timer();
+    enum copy_engine used_engine = copy_data(source_file, destination_file, &source_state, &sparse_copy);
+    stop_timer(PHASE_COPY, timer);
+    copy_hash = NULL;
+    if (used_engine != ENGINE_COUNT && __atomic_load_n(&preserve_attributes, __ATOMIC_RELAXED))
+        preserve_metadata(source_file, &source_state, destination_file, full_destination_path, NULL);
+    // a failed copy leaves an older destination as it was
+    if (used_engine != ENGINE_COUNT && durable_mode == DURABLE_FILE && !publish_file(destination_file, destination_dir->fd, destination_name, temporary_name))
+        used_engine = ENGINE_COUNT;
+    if (used_engine == ENGINE_COUNT)
+        discard_file(destination_dir->fd, temporary_name);
+    if (used_engine != ENGINE_COUNT && hashing)
+    {
+        unsigned long long source_hash = hash_final(&hash);
+        fingerprint.full_hash = source_hash;
+        fingerprint.has_full_hash = true;
+        if (verify && !verify_copy(destination_dir->fd, destination_name, full_destination_path, source_state.st_size, source_hash))
+            used_engine = ENGINE_COUNT;
+        else if (checksum_file)
+            write_checksum(full_destination_path, source_hash);
+    }
+    if (used_engine != ENGINE_COUNT)
+        printf("%sCopied %s => %s (%s%s%s)\n", clear_line, source_path, full_destination_path, engine_names[used_engine], sparse_copy ? ", sparse" : "", verify ? ", verified" : "");
 
     close(source_file);
     close(destination_file);
-    free(full_destination_path);
-    free(buffer);
+    record_file(source_path, used_engine, source_state.st_size, file_start);
+    if (first_name)
+        finish_link(source_state.st_dev, source_state.st_ino, used_engine != ENGINE_COUNT);
+    if (fingerprint.sampled && used_engine != ENGINE_COUNT)
+        add_dedup_entry(source_state.st_size, &fingerprint, destination_dir, destination_name);
+    if (progress_mode != PROGRESS_NONE)
+        __atomic_add_fetch(&progress.files, 1, __ATOMIC_RELAXED);
 }
-
-void copy_directory(const char *source_dir, const char *destination_dir, const char *dir_name, bool enable_overwrite_check)
+// Recreates a symbolic link with the same target, relative targets stay relative
+void copy_symlink(struct dir_handle *source_dir, const char *source_name, struct dir_handle *destination_dir, const char *link_name, bool enable_overwrite_check)
 {
-
-    if (!strcmp(source_dir, "/"))
+    char *source_path = build_path(&source_path_buffer, source_dir, source_name);
+    char *full_destination_path = build_path(&destination_path_buffer, destination_dir, link_name);
+    struct stat source_state;
+    char target[PATH_MAX];
+    unsigned long long timer = start_timer();
+    int result = fstatat(source_dir->fd, source_name, &source_state, AT_SYMLINK_NOFOLLOW);
+    stop_timer(PHASE_STAT, timer);
+    ssize_t length = result == 0 ? readlinkat(source_dir->fd, source_name, target, sizeof(target)) : -1;
+    if (length == -1)
     {
-        printf("Cannot copy root directory (/). Skipping copy.\n\n");
+        perror("Failed to read symbolic link");
         return;
     }
-
-    if (!(strcmp(source_dir, destination_dir)))
+    if (length == sizeof(target))
+    {
+        printf("%sThe target of symbolic link %s is too long, skipping.\n", clear_line, source_path);
+        return;
+    }
+    target[length] = '\0';
+
+    const char *destination_name = link_name;
+    enum source_type dest_type = get_link_type_at(destination_dir->fd, destination_name);
+    // --update: a link with the same target is unchanged, without it an existing link is a conflict like a file
+    char existing_target[PATH_MAX];
+    if (update_mode != UPDATE_NONE && dest_type == L && readlinkat(destination_dir->fd, destination_name, existing_target, sizeof(existing_target)) == length && !memcmp(existing_target, target, length))
+    {
+        printf("%sUnchanged %s => %s, skipping.\n", clear_line, source_path, full_destination_path);
+        if (stats_mode != STATS_NONE)
+            __atomic_add_fetch(&stats.unchanged_files, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    char new_name[256];
+    bool overwrite = false;
+    bool prompting = (dest_type == D || (dest_type != NOT_EXIST && enable_overwrite_check)) && __atomic_load_n(&conflict_policy, __ATOMIC_RELAXED) == CONFLICT_ASK;
+    timer = start_timer();
+    if (prompting)
+        pthread_mutex_lock(&prompt_lock);
+    while (prompting && dest_type != NOT_EXIST && __atomic_load_n(&conflict_policy, __ATOMIC_RELAXED) == CONFLICT_ASK)
+    {
+        if (dest_type == D)
+            printf("Destination %s is a directory.\nCannot overwrite a directory with a symbolic link.\n", full_destination_path);
+        else
+        {
+            printf("Destination %s already exists.\nDo you want to overwrite it by %s ? (y/n): ", full_destination_path, source_path);
+            char response = read_char();
+            NL;
+            if (feof(stdin))
+            {
+                stop_asking();
+                break;
+            }
+            if (response != 'y' && response != 'n')
+            {
+                printf("Invalid response. Please enter 'y' or 'n'.\n\n");
+                continue;
+            }
+            if (response == 'y')
+            {
+                overwrite = true;
+                break;
+            }
+        }
+        printf("Enter new name for %s: ", source_path);
+        if (!read_string(new_name, sizeof(new_name)))
+        {
+            stop_asking();
+            break;
+        }
+        NL;
+        destination_name = new_name;
+        full_destination_path = build_path(&destination_path_buffer, destination_dir, new_name);
+        dest_type = get_link_type_at(destination_dir->fd, new_name);
+    }
+    if (prompting)
+    {
+        pthread_mutex_unlock(&prompt_lock);
+        stop_timer(PHASE_PROMPT, timer);
+    }
+    char unique_name[256];
+    if (dest_type == D || (dest_type != NOT_EXIST && enable_overwrite_check && !overwrite))
+    {
+        enum conflict_decision decision = resolve_conflict(destination_dir->fd, destination_name, full_destination_path, L, dest_type, &source_state, unique_name, sizeof(unique_name));
+        if (decision == DECISION_SKIP)
+            return;
+        if (decision == DECISION_RENAME)
+        {
+            destination_name = unique_name;
+            full_destination_path = build_path(&destination_path_buffer, destination_dir, unique_name);
+        }
+    }
+
+    // an existing destination (or the name reserved by rename-auto) is replaced through a temporary name
+    char temporary_name[TEMPORARY_NAME_SIZE];
+    timer = start_timer();
+    if (dest_type == NOT_EXIST)
+        result = symlinkat(target, destination_dir->fd, destination_name);
+    else
+    {
+        make_temporary_name(temporary_name);
+        result = symlinkat(target, destination_dir->fd, temporary_name);
+        if (result == 0 && (result = renameat(destination_dir->fd, temporary_name, destination_dir->fd, destination_name)) == -1)
+        {
+            int error = errno;
+            unlinkat(destination_dir->fd, temporary_name, 0);
+            errno = error;
+        }
+    }
+    stop_timer(PHASE_OPEN, timer);
+    if (result == -1)
+    {
+        perror("Failed to create symbolic link");
+        return;
+    }
+    // a link has no fd, its attributes are set through its name
+    int attributes = __atomic_load_n(&preserve_attributes, __ATOMIC_RELAXED);
+    if ((attributes & PRESERVE_OWNERSHIP) && fchownat(destination_dir->fd, destination_name, source_state.st_uid, source_state.st_gid, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+        if (errno == EPERM)
+            drop_preserved(PRESERVE_OWNERSHIP, "Not allowed to change the owner of the copies, --preserve=ownership is off.\n");
+        else
+            perror("Failed to preserve ownership");
+    }
+    struct timespec times[2] = {source_state.st_atim, source_state.st_mtim};
+    if ((attributes & PRESERVE_TIMESTAMPS) && utimensat(destination_dir->fd, destination_name, times, AT_SYMLINK_NOFOLLOW) == -1)
+        perror("Failed to preserve timestamps");
+    printf("%sCopied %s => %s (symbolic link to %s)\n", clear_line, source_path, full_destination_path, target);
+    if (stats_mode != STATS_NONE)
+        __atomic_add_fetch(&stats.symlinks, 1, __ATOMIC_RELAXED);
+}
+
+
+// Clones, copies only the data extents of sparse files, or copies the whole file through the engine chain.
+// Returns the engine that moved the data or ENGINE_COUNT on failure
+enum copy_engine copy_data(int source_file, int destination_file, const struct stat *source_state, bool *sparse_copy)
+{
+    *sparse_copy = false;
+    // a hashed copy has to read the data, clones are skipped (main() rejects --reflink=always with hashing)
+    if (reflink_mode != REFLINK_NEVER && copy_hash == NULL)
+    {
+        enum copy_result result = copy_with_reflink(source_file, destination_file);
+        if (result == COPY_DONE)
+        {
+            add_progress(source_state->st_size);
+            return ENGINE_REFLINK;
+        }
+        if (reflink_mode == REFLINK_ALWAYS)
+        {
+            if (result == COPY_UNSUPPORTED)
+                printf("Filesystem can't clone this file (--reflink=always).\n");
+            return ENGINE_COUNT;
+        }
+    }
+
+    // fewer allocated blocks than the size means the file has holes
+    if (sparse_mode == SPARSE_AUTO && source_state->st_blocks * 512 < source_state->st_size)
+    {
+        enum copy_engine engine = ENGINE_COUNT;
+        enum copy_result result = copy_sparse(source_file, destination_file, source_state, &engine);
+        if (result != COPY_UNSUPPORTED)
+        {
+            *sparse_copy = true;
+            return result == COPY_DONE ? engine : ENGINE_COUNT;
+        }
+    }
+    if (!preallocate_range(destination_file, 0, source_state->st_size))
+        return ENGINE_COUNT;
+    if (direct_threshold > 0 && source_state->st_size >= direct_threshold)
+    {
+        enum copy_result result = copy_with_direct(source_file, destination_file, source_state->st_size);
+        if (result != COPY_UNSUPPORTED)
+            return check_copied_size(source_file, destination_file, source_state, result == COPY_DONE ? ENGINE_DIRECT : ENGINE_COUNT);
+    }
+    if (file_threads > 1 && source_state->st_size > chunk_size && copy_hash == NULL)
+    {
+        enum copy_result result = copy_with_chunks(source_file, destination_file, source_state->st_size);
+        return check_copied_size(source_file, destination_file, source_state, result == COPY_DONE ? ENGINE_CHUNKED : ENGINE_COUNT);
+    }
+    return check_copied_size(source_file, destination_file, source_state, copy_range(source_file, destination_file, -1, source_state->st_size));
+}
+
+// Fails an [engine] that wrote less than the stat'ed size, unless the source shrank to what was written meanwhile.
+// Clones and sparse copies are sized by the copy itself and aren't checked
+enum copy_engine check_copied_size(int source_file, int destination_file, const struct stat *source_state, enum copy_engine engine)
+{
+    struct stat source_now, destination_state;
+    if (engine == ENGINE_COUNT || fstat(destination_file, &destination_state) == -1 || destination_state.st_size >= source_state->st_size)
+        return engine;
+    if (fstat(source_file, &source_now) == 0 && destination_state.st_size == source_now.st_size)
+        return engine;
+    printf("%sThe copy stopped after %lld of %lld bytes (%s).\n", clear_line, (long long)destination_state.st_size, (long long)source_state->st_size, engine_names[engine]);
+    return ENGINE_COUNT;
+}
+
+// Reserves the blocks of a range up front so large files are laid out contiguously and a full disk fails the file
+// before any data is written. Returns false only when there isn't enough space
+bool preallocate_range(int destination_file, off_t offset, off_t length)
+{
+    // small files don't fragment, skip the extra syscall
+    if (!preallocate || length <= SMALL_COPY_SIZE)
+        return true;
+    // KEEP_SIZE: the file still grows with the writes, so a source that shrinks meanwhile leaves no zero tail
+    if (fallocate(destination_file, FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+        return true;
+    if (errno == ENOSPC || errno == EDQUOT || errno == EFBIG)
+    {
+        perror("Failed to preallocate destination file");
+        return false;
+    }
+    // not supported by the filesystem, posix_fallocate would write zeros instead so just copy
+    return true;
+}
+
+// Tries the engines from first_engine down to read_write on the data between the current file offsets and
+// [limit] bytes later (-1: until EOF). [size] is how many bytes are expected there.
+enum copy_engine copy_range(int source_file, int destination_file, off_t limit, off_t size)
+{
+    enum copy_result result = COPY_UNSUPPORTED;
+    // only the read()/write() loop sees the data in order
+    enum copy_engine engine = copy_hash ? ENGINE_READ_WRITE : first_engine;
+    for (; engine < ENGINE_COUNT; engine++)
+    {
+        if (engine == ENGINE_COPY_FILE_RANGE)
+            result = copy_with_copy_file_range(source_file, destination_file, limit, size);
+        else if (engine == ENGINE_SENDFILE)
+            result = copy_with_sendfile(source_file, destination_file, limit, size);
+        else if (engine == ENGINE_SPLICE)
+            result = copy_with_splice(source_file, destination_file, limit, size);
+        else if (engine == ENGINE_IO_URING)
+            result = copy_with_io_uring(source_file, destination_file, limit, size);
+        else
+            result = copy_with_read_write(source_file, destination_file, limit, size);
+
+        if (result != COPY_UNSUPPORTED)
+            break;
+    }
+    return result == COPY_DONE ? engine : ENGINE_COUNT;
+}
+
+// Copies only the data extents, the destination was truncated so skipping a hole leaves a hole there too.
+// [engine] is set to the engine that copied the extents
+enum copy_result copy_sparse(int source_file, int destination_file, const struct stat *source_state, enum copy_engine *engine)
+{
+    *engine = first_engine;
+    off_t data, hole = 0;
+    while ((data = lseek(source_file, hole, SEEK_DATA)) != -1)
+    {
+        if (copy_hash)
+            hash_zeros(data - hole);
+        hole = lseek(source_file, data, SEEK_HOLE);
+        if (hole == -1 || lseek(source_file, data, SEEK_SET) == -1 || lseek(destination_file, data, SEEK_SET) == -1)
+        {
+            perror("Failed to seek in sparse file");
+            return COPY_FAILED;
+        }
+        // only the data extents, preallocating holes would fill them
+        if (!preallocate_range(destination_file, data, hole - data))
+            return COPY_FAILED;
+        *engine = copy_range(source_file, destination_file, hole - data, hole - data);
+        if (*engine == ENGINE_COUNT)
+            return COPY_FAILED;
+    }
+    // ENXIO: no data after [hole]
+    if (errno != ENXIO)
+    {
+        if (hole == 0 && is_unsupported_error(errno))
+            return COPY_UNSUPPORTED;
+        perror("Failed to find data in sparse file");
+        return COPY_FAILED;
+    }
+    if (copy_hash)
+        hash_zeros(source_state->st_size - hole);
+    // recreate the trailing hole
+    if (ftruncate(destination_file, source_state->st_size) == -1)
+    {
+        perror("Failed to resize destination file");
+        return COPY_FAILED;
+    }
+    return COPY_DONE;
+}
+
+// errors meaning "this engine can't handle these files", not a real I/O failure
+bool is_unsupported_error(int error)
+{
+    return error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP || error == EBADF;
+}
+
+// how many bytes the next call may move, capped at [max_chunk]
+size_t next_chunk(off_t limit, off_t copied, size_t max_chunk)
+{
+    if (limit < 0 || limit - copied > (off_t)max_chunk)
+        return max_chunk;
+    return limit - copied;
+}
+
+enum copy_result copy_with_reflink(int source_file, int destination_file)
+{
+    if (ioctl(destination_file, FICLONE, source_file) == 0)
+        return COPY_DONE;
+    // different filesystems or no reflink support
+    if (is_unsupported_error(errno) || errno == ENOTTY)
+        return COPY_UNSUPPORTED;
+    perror("Failed to clone file (FICLONE)");
+    return COPY_FAILED;
+}
+
+// Copies from offset 0 with O_DIRECT so huge files don't evict the page cache. The pooled buffers and every
+// offset are BUFFER_ALIGNMENT aligned, only the unaligned tail at EOF is written through the page cache
+enum copy_result copy_with_direct(int source_file, int destination_file, off_t size)
+{
+    if (!set_direct_io(source_file, true))
+        return COPY_UNSUPPORTED;
+    if (!set_direct_io(destination_file, true))
+    {
+        set_direct_io(source_file, false);
+        return COPY_UNSUPPORTED;
+    }
+    struct copy_buffer *buffer = acquire_buffer(size);
+    if (buffer == NULL)
+    {
+        set_direct_io(source_file, false);
+        set_direct_io(destination_file, false);
+        return COPY_UNSUPPORTED;
+    }
+
+    enum copy_result result = COPY_DONE;
+    off_t copied = 0;
+    ssize_t bytes;
+    while ((bytes = read(source_file, buffer->data, buffer->size)) > 0)
+    {
+        if (copy_hash)
+            hash_update(copy_hash, buffer->data, bytes);
+        ssize_t aligned = bytes & ~(ssize_t)(BUFFER_ALIGNMENT - 1);
+        if (aligned > 0 && write(destination_file, buffer->data, aligned) != aligned)
+        {
+            bytes = -1;
+            break;
+        }
+        if (aligned != bytes)
+        {
+            // the offsets aren't aligned anymore, finish through the page cache
+            set_direct_io(source_file, false);
+            set_direct_io(destination_file, false);
+            if (write(destination_file, buffer->data + aligned, bytes - aligned) != bytes - aligned)
+            {
+                bytes = -1;
+                break;
+            }
+        }
+        copied += bytes;
+        add_progress(bytes);
+    }
+    if (bytes == -1)
+    {
+        // filesystems that accept the flag but not the I/O. The first read already moved the source offset and went
+        // into the hash, both are rewound for the next engine
+        if (copied == 0 && errno == EINVAL && lseek(source_file, 0, SEEK_SET) == 0 && lseek(destination_file, 0, SEEK_SET) == 0)
+        {
+            if (copy_hash)
+                hash_init(copy_hash);
+            result = COPY_UNSUPPORTED;
+        }
+        else
+        {
+            perror("Failed to copy file (O_DIRECT)");
+            result = COPY_FAILED;
+        }
+    }
+    release_buffer(buffer);
+    set_direct_io(source_file, false);
+    set_direct_io(destination_file, false);
+    return result;
+}
+
+// Splits the file into --chunk-size ranges copied by --file-threads threads (this one included)
+enum copy_result copy_with_chunks(int source_file, int destination_file, off_t size)
+{
+    struct chunked_copy copy = {source_file, destination_file, size, 0, false};
+    int thread_count = file_threads;
+    if ((size + chunk_size - 1) / chunk_size < thread_count)
+        thread_count = (size + chunk_size - 1) / chunk_size;
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+    int started = 0;
+    // threads that fail to start just leave more chunks to the others
+    while (started < thread_count - 1 && pthread_create(&threads[started], NULL, copy_chunks, &copy) == 0)
+        started++;
+    copy_chunks(&copy);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    return copy.failed ? COPY_FAILED : COPY_DONE;
+}
+
+void *copy_chunks(void *arg)
+{
+    struct chunked_copy *copy = arg;
+    struct copy_buffer *buffer = NULL; // only needed when copy_file_range can't be used
+    off_t offset;
+    while (!__atomic_load_n(&copy->failed, __ATOMIC_RELAXED) && (offset = __atomic_fetch_add(&copy->next_offset, chunk_size, __ATOMIC_RELAXED)) < copy->size)
+    {
+        off_t end = offset + chunk_size < copy->size ? offset + chunk_size : copy->size;
+        if (!copy_chunk(copy->source_file, copy->destination_file, offset, end, &buffer))
+            __atomic_store_n(&copy->failed, true, __ATOMIC_RELAXED);
+    }
+    if (buffer)
+        release_buffer(buffer);
+    return NULL;
+}
+
+// Copies [offset, end) with copy_file_range at explicit offsets, or pread/pwrite where it isn't supported
+bool copy_chunk(int source_file, int destination_file, off_t offset, off_t end, struct copy_buffer **buffer)
+{
+    loff_t in = offset, out = offset;
+    ssize_t bytes = 1;
+    while (in < end && (bytes = copy_file_range(source_file, &in, destination_file, &out, end - in, 0)) > 0)
+        add_progress(bytes);
+    // EOF, the file shrank since it was stat'ed
+    if (in >= end || bytes == 0)
+        return true;
+    if (!is_unsupported_error(errno))
+    {
+        perror("Failed to copy file chunk (copy_file_range)");
+        return false;
+    }
+
+    if (*buffer == NULL && (*buffer = acquire_buffer(chunk_size)) == NULL)
+    {
+        printf("Failed to allocate memory for file copy buffer.\n");
+        return false;
+    }
+    while (in < end && (bytes = pread(source_file, (*buffer)->data, next_chunk(end - in, 0, (*buffer)->size), in)) > 0)
+    {
+        if (pwrite(destination_file, (*buffer)->data, bytes, in) != bytes)
+        {
+            perror("Failed to write file chunk");
+            return false;
+        }
+        in += bytes;
+        add_progress(bytes);
+    }
+    if (bytes == -1)
+    {
+        perror("Failed to read file chunk");
+        return false;
+    }
+    return true;
+}
+
+bool set_direct_io(int fd, bool enable)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1)
+        return false;
+    return fcntl(fd, F_SETFL, enable ? flags | O_DIRECT : flags & ~O_DIRECT) == 0;
+}
+
+enum copy_result copy_with_copy_file_range(int source_file, int destination_file, off_t limit, off_t size)
+{
+    off_t copied = 0;
+    ssize_t bytes = 0;
+    while (copied != limit && (bytes = copy_file_range(source_file, NULL, destination_file, NULL, next_chunk(limit, copied, 1 << 30), 0)) > 0)
+    {
+        copied += bytes;
+        add_progress(bytes);
+    }
+
+    if (bytes == -1)
+    {
+        if (copied == 0 && is_unsupported_error(errno))
+            return COPY_UNSUPPORTED;
+        perror("Failed to copy file (copy_file_range)");
+        return COPY_FAILED;
+    }
+    // pseudo files (procfs, sysfs) report EOF right away, let a reading engine handle them
+    if (copied == 0 && size > 0)
+        return COPY_UNSUPPORTED;
+    return COPY_DONE;
+}
+
+enum copy_result copy_with_sendfile(int source_file, int destination_file, off_t limit, off_t size)
+{
+    off_t copied = 0;
+    ssize_t bytes = 0;
+    while (copied != limit && (bytes = sendfile(destination_file, source_file, NULL, next_chunk(limit, copied, 1 << 30))) > 0)
+    {
+        copied += bytes;
+        add_progress(bytes);
+    }
+
+    if (bytes == -1)
+    {
+        if (copied == 0 && is_unsupported_error(errno))
+            return COPY_UNSUPPORTED;
+        perror("Failed to copy file (sendfile)");
+        return COPY_FAILED;
+    }
+    if (copied == 0 && size > 0)
+        return COPY_UNSUPPORTED;
+    return COPY_DONE;
+}
+
+enum copy_result copy_with_splice(int source_file, int destination_file, off_t limit, off_t size)
+{
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1)
+        return COPY_UNSUPPORTED;
+
+    enum copy_result result = COPY_DONE;
+    off_t copied = 0;
+    ssize_t bytes = 0;
+    while (copied != limit && (bytes = splice(source_file, NULL, pipe_fds[1], NULL, next_chunk(limit, copied, 64 * 1024), SPLICE_F_MOVE)) > 0)
+    {
+        // drain the pipe into the destination before filling it again
+        while (bytes > 0)
+        {
+            ssize_t written = splice(pipe_fds[0], NULL, destination_file, NULL, bytes, SPLICE_F_MOVE);
+            if (written <= 0)
+            {
+                perror("Failed to write to destination file (splice)");
+                result = COPY_FAILED;
+                break;
+            }
+            bytes -= written;
+            copied += written;
+            add_progress(written);
+        }
+        if (result == COPY_FAILED)
+            break;
+    }
+
+    if (bytes == -1)
+    {
+        if (copied == 0 && is_unsupported_error(errno))
+            result = COPY_UNSUPPORTED;
+        else
+        {
+            perror("Failed to read from source file (splice)");
+            result = COPY_FAILED;
+        }
+    }
+    else if (result == COPY_DONE && copied == 0 && size > 0)
+        result = COPY_UNSUPPORTED;
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return result;
+}
+
+// Maps the rings of a new io_uring instance, returns false (and keeps the engine disabled) when the kernel refuses
+bool setup_io_uring()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, URING_DEPTH * 2, &params);
+    if (fd == -1)
+        return false;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    struct io_uring_sqe *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+
+    uring.fd = fd;
+    uring.sq_ring = sq;
+    uring.sq_size = sq_size;
+    uring.cq_ring = cq;
+    uring.cq_size = cq_size;
+    uring.sqes = sqes;
+    uring.sqe_count = params.sq_entries;
+    uring.sq_head = (unsigned *)(sq + params.sq_off.head);
+    uring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    uring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+void close_io_uring()
+{
+    if (uring.fd < 0)
+        return;
+    munmap(uring.sqes, uring.sqe_count * sizeof(struct io_uring_sqe));
+    if (uring.cq_ring != uring.sq_ring)
+        munmap(uring.cq_ring, uring.cq_size);
+    munmap(uring.sq_ring, uring.sq_size);
+    close(uring.fd);
+    uring.fd = -1;
+}
+
+// Queues a read or write of [length] bytes at [offset], [link] chains the next queued request to this one
+void queue_io_uring(int opcode, int fd, char *buffer, unsigned length, off_t offset, unsigned long long user_data, bool link)
+{
+    unsigned tail = *uring.sq_tail;
+    unsigned index = tail & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    sqe->user_data = user_data;
+    uring.sq_array[index] = index;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Copies a range with up to URING_DEPTH linked read->write pairs in flight, each pair on its own slice of one pooled buffer.
+// A pair broken by a short read (file changed size) is redone with pread/pwrite
+enum copy_result copy_with_io_uring(int source_file, int destination_file, off_t limit, off_t size)
+{
+    off_t total = limit < 0 ? size : limit;
+    if (total <= 0)
+        return COPY_UNSUPPORTED;
+    if (uring.fd < 0 && (uring_unavailable || !setup_io_uring()))
+    {
+        uring_unavailable = true;
+        return COPY_UNSUPPORTED;
+    }
+
+    off_t source_start = lseek(source_file, 0, SEEK_CUR);
+    off_t destination_start = lseek(destination_file, 0, SEEK_CUR);
+    struct copy_buffer *pooled = acquire_buffer(total);
+    if (source_start == -1 || destination_start == -1 || pooled == NULL)
+    {
+        if (pooled)
+            release_buffer(pooled);
+        return COPY_UNSUPPORTED;
+    }
+
+    struct uring_slot
+    {
+        off_t offset;
+        unsigned length;
+        int read_result;
+        bool busy;
+    } slots[URING_DEPTH];
+    memset(slots, 0, sizeof(slots));
+    size_t slot_size = (pooled->size / URING_DEPTH) & ~(size_t)(BUFFER_ALIGNMENT - 1);
+    if (slot_size == 0)
+        slot_size = pooled->size;
+    int slot_count = pooled->size / slot_size;
+    if (slot_count > URING_DEPTH)
+        slot_count = URING_DEPTH;
+
+    enum copy_result result = COPY_DONE;
+    off_t queued = 0, copied = 0;
+    int in_flight = 0;
+    // every request the kernel took from the ring posts one completion
+    unsigned taken_start = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE), completed = 0;
+    while ((queued < total && result == COPY_DONE) || in_flight > 0)
+    {
+        int to_submit = 0;
+        for (int i = 0; i < slot_count && queued < total && result == COPY_DONE; i++)
+        {
+            if (slots[i].busy)
+                continue;
+            slots[i].busy = true;
+            slots[i].offset = queued;
+            slots[i].length = next_chunk(total, queued, slot_size);
+            char *data = pooled->data + i * slot_size;
+            queue_io_uring(IORING_OP_READ, source_file, data, slots[i].length, source_start + queued, i * 2, true);
+            queue_io_uring(IORING_OP_WRITE, destination_file, data, slots[i].length, destination_start + queued, i * 2 + 1, false);
+            queued += slots[i].length;
+            to_submit += 2;
+            in_flight++;
+        }
+        if (syscall(__NR_io_uring_enter, uring.fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR)
+        {
+            // submissions can't be tracked anymore, stop using io_uring for the rest of the run. The requests already
+            // taken may still read into or write from the buffer, it's only reused once they completed
+            perror("Failed to submit io_uring requests");
+            if (!wait_io_uring(__atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) - taken_start - completed))
+                pooled = NULL;
+            close_io_uring();
+            uring_unavailable = true;
+            result = COPY_FAILED;
+            break;
+        }
+
+        unsigned head = *uring.cq_head;
+        while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+            struct uring_slot *slot = &slots[cqe->user_data / 2];
+            char *data = pooled->data + (cqe->user_data / 2) * slot_size;
+            head++;
+            completed++;
+            if (cqe->user_data % 2 == 0)
+            {
+                slot->read_result = cqe->res;
+                continue;
+            }
+
+            // the write completes (or is cancelled) after its read, the slot is free afterwards
+            slot->busy = false;
+            in_flight--;
+            if (cqe->res == (int)slot->length)
+            {
+                copied += slot->length;
+                add_progress(slot->length);
+                continue;
+            }
+            if (result != COPY_DONE)
+                continue;
+            if (copied == 0 && (slot->read_result == -EINVAL || slot->read_result == -EOPNOTSUPP))
+                result = COPY_UNSUPPORTED; // kernel without IORING_OP_READ/WRITE
+            else if (slot->read_result < 0 && slot->read_result != -ECANCELED)
+            {
+                printf("Failed to read from source file (io_uring): %s\n", strerror(-slot->read_result));
+                result = COPY_FAILED;
+            }
+            else if (cqe->res < 0 && cqe->res != -ECANCELED)
+            {
+                printf("Failed to write to destination file (io_uring): %s\n", strerror(-cqe->res));
+                result = COPY_FAILED;
+            }
+            else
+            {
+                off_t done = 0;
+                ssize_t bytes = 1;
+                while (done < slot->length && (bytes = pread(source_file, data, slot->length - done, source_start + slot->offset + done)) > 0)
+                {
+                    if (pwrite(destination_file, data, bytes, destination_start + slot->offset + done) != bytes)
+                    {
+                        bytes = -1;
+                        break;
+                    }
+                    done += bytes;
+                }
+                if (bytes == -1)
+                {
+                    perror("Failed to copy file (io_uring)");
+                    result = COPY_FAILED;
+                }
+                copied += done;
+                add_progress(done);
+            }
+        }
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    // a buffer the ring may still use is leaked rather than handed to the next file
+    if (pooled)
+        release_buffer(pooled);
+
+    if (result == COPY_DONE)
+    {
+        // leave the offsets where a sequential engine would have
+        lseek(source_file, source_start + copied, SEEK_SET);
+        lseek(destination_file, destination_start + copied, SEEK_SET);
+        // like the other engines, a whole file is read until EOF, also when it grew since it was stat'ed
+        if (limit < 0)
+            result = copy_with_read_write(source_file, destination_file, -1, 0);
+    }
+    return result;
+}
+
+// Reaps [outstanding] completions, whatever their result. Returns false when the kernel can't be waited on
+bool wait_io_uring(unsigned outstanding)
+{
+    while (outstanding > 0)
+    {
+        unsigned head = *uring.cq_head;
+        while (outstanding > 0 && head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE))
+        {
+            head++;
+            outstanding--;
+        }
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+        if (outstanding > 0 && syscall(__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR)
+            return false;
+    }
+    return true;
+}
+
+enum copy_result copy_with_read_write(int source_file, int destination_file, off_t limit, off_t size)
+{
+    char small_buffer[SMALL_COPY_SIZE];
+    struct copy_buffer *pooled = NULL;
+    char *buffer = small_buffer;
+    size_t buffer_size = sizeof(small_buffer);
+    if (size > SMALL_COPY_SIZE)
+    {
+        pooled = acquire_buffer(limit < 0 ? size : limit);
+        if (pooled == NULL)
+        {
+            printf("Failed to allocate memory for file copy buffer.\n");
+            return COPY_FAILED;
+        }
+        buffer = pooled->data;
+        buffer_size = pooled->size;
+    }
+    enum copy_result result = COPY_DONE;
+    off_t copied = 0;
+    ssize_t bytes = 0;
+    while (copied != limit && (bytes = read(source_file, buffer, next_chunk(limit, copied, buffer_size))) > 0)
+    {
+        if (write(destination_file, buffer, bytes) != bytes)
+        {
+            perror("Failed to write to destination file");
+            result = COPY_FAILED;
+            break;
+        }
+        if (copy_hash)
+            hash_update(copy_hash, buffer, bytes);
+        copied += bytes;
+        add_progress(bytes);
+    }
+
+    if (bytes == -1)
+    {
+        perror("Failed to read from source file");
+        result = COPY_FAILED;
+    }
+    if (pooled)
+        release_buffer(pooled);
+    return result;
+}
+
+// Returns a free buffer of at least the file size (power of two, between MIN_BUFFER_SIZE and MAX_BUFFER_SIZE),
+// or allocates one when the pool has none. Stays inside the budget by dropping free buffers or using a smaller one
+struct copy_buffer *acquire_buffer(off_t file_size)
+{
+    size_t size = MIN_BUFFER_SIZE;
+    while (size < (size_t)file_size && size < MAX_BUFFER_SIZE)
+        size *= 2;
+
+    pthread_mutex_lock(&buffer_pool.lock);
+    // smallest free buffer that fits the whole file, otherwise the largest one
+    struct copy_buffer **best = NULL;
+    for (struct copy_buffer **it = &buffer_pool.free_buffers; *it; it = &(*it)->next)
+    {
+        if (!best || ((*best)->size < size && (*it)->size > (*best)->size) || ((*it)->size >= size && (*it)->size < (*best)->size))
+            best = it;
+    }
+    if (best && ((*best)->size >= size || buffer_pool.allocated + size > buffer_pool.budget))
+    {
+        struct copy_buffer *buffer = *best;
+        *best = buffer->next;
+        pthread_mutex_unlock(&buffer_pool.lock);
+        return buffer;
+    }
+
+    // make room for a bigger buffer by dropping the free ones
+    while (buffer_pool.free_buffers && buffer_pool.allocated + size > buffer_pool.budget)
+    {
+        struct copy_buffer *dropped = buffer_pool.free_buffers;
+        buffer_pool.free_buffers = dropped->next;
+        buffer_pool.allocated -= dropped->size;
+        free(dropped->data);
+        free(dropped);
+    }
+    while (size > BUFFER_ALIGNMENT && buffer_pool.allocated + size > buffer_pool.budget)
+        size /= 2;
+    // reserve the size so parallel copies don't overshoot the budget together
+    buffer_pool.allocated += size;
+    pthread_mutex_unlock(&buffer_pool.lock);
+
+    struct copy_buffer *buffer = malloc(sizeof(struct copy_buffer));
+    size_t reserved = size;
+    while (buffer && posix_memalign((void **)&buffer->data, BUFFER_ALIGNMENT, size) != 0)
+    {
+        if (size <= BUFFER_ALIGNMENT)
+        {
+            free(buffer);
+            buffer = NULL;
+            break;
+        }
+        size /= 2;
+    }
+    pthread_mutex_lock(&buffer_pool.lock);
+    buffer_pool.allocated -= reserved - (buffer ? size : 0);
+    pthread_mutex_unlock(&buffer_pool.lock);
+    if (buffer)
+        buffer->size = size;
+    return buffer;
+}
+
+void release_buffer(struct copy_buffer *buffer)
+{
+    pthread_mutex_lock(&buffer_pool.lock);
+    buffer->next = buffer_pool.free_buffers;
+    buffer_pool.free_buffers = buffer;
+    pthread_mutex_unlock(&buffer_pool.lock);
+}
+
+void free_buffer_pool()
+{
+    while (buffer_pool.free_buffers)
+    {
+        struct copy_buffer *buffer = buffer_pool.free_buffers;
+        buffer_pool.free_buffers = buffer->next;
+        free(buffer->data);
+        free(buffer);
+    }
+    buffer_pool.allocated = 0;
+}
+
+void copy_directory(struct dir_handle *source_parent, const char *source_name, struct dir_handle *destination_dir, const char *dir_name, bool enable_overwrite_check)
+{
+    // both paths are overwritten by the entries copied below, the handles keep their own copies
+    char *source_dir = build_path(&source_path_buffer, source_parent, source_name);
+
+    if (!strcmp(source_dir, "/"))
+    {
+        printf("Cannot copy root directory (/). Skipping copy.\n\n");
+        return;
+    }
+
+    if (!(strcmp(source_dir, destination_dir->path)))
     {
         printf("Source and destination paths are the same (%s). Skipping copy.\n\n", source_dir);
         return;
     }
 
-    int source_len = strlen(source_dir);
-    int dest_len = strlen(destination_dir);
+    int source_len = strlen(source_dir);
+    int dest_len = destination_dir->path_length;
+
+    // used [destination_dir[source_len] == '/']
+    // cuz it might be like from : /home/user/dir1 to /home/user/dir123
+    if (dest_len > source_len && !strncmp(source_dir, destination_dir->path, source_len) && destination_dir->path[source_len] == '/')
+    {
+        printf("Cannot copy parent directory (%s) into its child (%s). Skipping copy.\n\n", source_dir, destination_dir->path);
+        return;
+    }
+
+    struct dir_handle *source = open_dir_handle(source_parent, source_name, source_dir);
+    if (!source)
+    {
+        perror("Failed to open source directory");
+        return;
+    }
+    struct dir_handle *repeated = symlink_mode == SYMLINKS_FOLLOW ? find_directory_cycle(source) : NULL;
+    if (repeated)
+    {
+        printf("%sSource %s is a link to its parent directory %s, skipping.\n", clear_line, source_dir, repeated->path);
+        unuse_dir_handle(source);
+        release_dir_handle(source);
+        return;
+    }
+    bool recursive_overwrite_check = enable_overwrite_check;
+    // --update merges into existing directories, only their files are checked for conflicts
+    bool directory_check = enable_overwrite_check && update_mode == UPDATE_NONE;
+
+    const char *destination_name = dir_name;
+    char *full_destination_path = build_path(&destination_path_buffer, destination_dir, dir_name);
+
+    enum source_type dest_type = get_source_type_at(destination_dir->fd, destination_name);
+
+    if (dest_type == NOT_EXIST)
+        recursive_overwrite_check = false;
+
+    char new_name[256];
+    bool overwrite = false;
+    bool prompting = (dest_type == F || (dest_type == D && directory_check)) && __atomic_load_n(&conflict_policy, __ATOMIC_RELAXED) == CONFLICT_ASK;
+    unsigned long long timer = start_timer();
+    if (prompting)
+        pthread_mutex_lock(&prompt_lock);
+    while (prompting && dest_type == F && __atomic_load_n(&conflict_policy, __ATOMIC_RELAXED) == CONFLICT_ASK)
+    {
+        printf("Destination %s is a file.\nCannot overwrite a file with a directory.\nEnter new name for %s: ", full_destination_path, source_dir);
+        if (!read_string(new_name, sizeof(new_name)))
+        {
+            stop_asking();
+            break;
+        }
+        NL;
+        destination_name = new_name;
+        full_destination_path = build_path(&destination_path_buffer, destination_dir, new_name);
+        dest_type = get_source_type_at(destination_dir->fd, new_name);
+        if (dest_type == NOT_EXIST)
+            recursive_overwrite_check = false;
+    }
+    while (prompting && dest_type == D && directory_check && __atomic_load_n(&conflict_policy, __ATOMIC_RELAXED) == CONFLICT_ASK)
+    {
+        printf("Destination %s already exists.\nDo you want to overwrite it by %s ? (y/n): ", full_destination_path, source_dir);
+        char want_overwrite = read_char();
+        NL;
+        if (feof(stdin))
+        {
+            stop_asking();
+            break;
+        }
+
+        if (want_overwrite != 'y' && want_overwrite != 'n')
+        {
+            printf("Invalid response. Please enter 'y' or 'n'.\n\n");
+            continue;
+        }
+        if (want_overwrite == 'n')
+        {
+            printf("Enter new name for %s: ", source_dir);
+            if (!read_string(new_name, sizeof(new_name)))
+            {
+                stop_asking();
+                break;
+            }
+            NL;
+            destination_name = new_name;
+            full_destination_path = build_path(&destination_path_buffer, destination_dir, new_name);
+        }
+        else
+        {
+            overwrite = true;
+            break;
+        }
+
+        dest_type = get_source_type_at(destination_dir->fd, destination_name);
+        if (dest_type == NOT_EXIST)
+            recursive_overwrite_check = false;
+    }
+    if (prompting)
+    {
+        pthread_mutex_unlock(&prompt_lock);
+        stop_timer(PHASE_PROMPT, timer);
+    }
+    char unique_name[256];
+    if (dest_type == F || (dest_type == D && directory_check && !overwrite))
+    {
+        enum conflict_decision decision = resolve_conflict(destination_dir->fd, destination_name, full_destination_path, D, dest_type, NULL, unique_name, sizeof(unique_name));
+        if (decision == DECISION_SKIP)
+        {
+            unuse_dir_handle(source);
+            release_dir_handle(source);
+            return;
+        }
+        if (decision == DECISION_RENAME)
+        {
+            destination_name = unique_name;
+            full_destination_path = build_path(&destination_path_buffer, destination_dir, unique_name);
+            recursive_overwrite_check = false;
+        }
+    }
+
+    // Create the destination directory
+    struct dir_handle *destination = NULL;
+    if (make_dir_at(destination_dir->fd, destination_name))
+    {
+        destination = open_dir_handle(destination_dir, destination_name, full_destination_path);
+        if (!destination)
+            perror("Failed to open destination directory");
+        else
+        {
+            if (stats_mode != STATS_NONE)
+                __atomic_add_fetch(&stats.directories, 1, __ATOMIC_RELAXED);
+            if (durable_mode != DURABLE_NONE)
+                track_filesystem(destination->fd);
+            struct stat source_state;
+            if (__atomic_load_n(&preserve_attributes, __ATOMIC_RELAXED) && fstat(source->fd, &source_state) == 0)
+                preserve_metadata(source->fd, &source_state, destination->fd, full_destination_path, destination);
+        }
+    }
+    if (!destination)
+    {
+        unuse_dir_handle(source);
+        release_dir_handle(source);
+        return;
+    }
+    struct dir_scanner scanner = {source->fd, acquire_scan_buffer(), 0, 0};
+    struct dirent64 *entry;
+
+    while (!__atomic_load_n(&conflict_stop, __ATOMIC_RELAXED) && (entry = next_dir_entry(&scanner)) != NULL)
+    {
+        // Skip the "." and ".." entries
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        enum source_type src_type = get_entry_type(source->fd, entry);
+        if (src_type != NOT_EXIST)
+            copy_entry(src_type, source, entry->d_name, destination, entry->d_name, recursive_overwrite_check);
+        else
+            printf("Can't find Source %s/%s . Skipping.\n\n", source->path, entry->d_name);
+    }
+    release_scan_buffer();
+
+    // the subdirectories queued above keep both handles, but the budget may close them until they run
+    unuse_dir_handle(source);
+
+    release_dir_handle(source);
+    unuse_dir_handle(destination);
+    release_dir_handle(destination);
+}
+
+// Opens [name] inside [parent] with one reference held by the caller. The handle is in use until
+// unuse_dir_handle(), and keeps its parent so it can be reopened through it after the budget closes it
+struct dir_handle *open_dir_handle(struct dir_handle *parent, const char *name, const char *path)
+{
+    pthread_mutex_lock(&dir_budget.lock);
+    close_idle_dirs(dir_budget.limit - 1);
+    // counted before opening, so parallel opens can't all pass the check
+    dir_budget.open++;
+    pthread_mutex_unlock(&dir_budget.lock);
+    unsigned long long timer = start_timer();
+    int fd = openat(parent->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    stop_timer(PHASE_SCAN, timer);
+    if (fd == -1)
+    {
+        int error = errno;
+        pthread_mutex_lock(&dir_budget.lock);
+        dir_budget.open--;
+        pthread_mutex_unlock(&dir_budget.lock);
+        errno = error;
+        return NULL;
+    }
+    size_t path_length = strlen(path);
+    struct dir_handle *handle = malloc(sizeof(struct dir_handle) + path_length + 1);
+    handle->fd = fd;
+    handle->path = (char *)(handle + 1);
+    memcpy(handle->path, path, path_length + 1);
+    handle->path_length = path_length;
+    handle->references = 1;
+    handle->users = 1;
+    handle->restore_metadata = false;
+    handle->device = 0;
+    handle->inode = 0;
+    handle->parent = parent == &cwd_handle ? NULL : retain_dir_handle(parent);
+    pthread_mutex_lock(&dir_budget.lock);
+    link_newest_dir(handle);
+    pthread_mutex_unlock(&dir_budget.lock);
+    return handle;
+}
+
+struct dir_handle *retain_dir_handle(struct dir_handle *handle)
+{
+    __atomic_add_fetch(&handle->references, 1, __ATOMIC_RELAXED);
+    return handle;
+}
+
+void release_dir_handle(struct dir_handle *handle)
+{
+    // a loop instead of recursion, the last step of a deep branch releases all of its parents
+    while (handle != NULL && __atomic_sub_fetch(&handle->references, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        struct dir_handle *parent = handle->parent;
+        // every entry of the directory is done, nothing changes its times anymore
+        if (handle->restore_metadata)
+            restore_dir_metadata(handle);
+        pthread_mutex_lock(&dir_budget.lock);
+        if (handle->fd != -1)
+        {
+            close(handle->fd);
+            unlink_dir(handle);
+            dir_budget.open--;
+        }
+        pthread_mutex_unlock(&dir_budget.lock);
+        free(handle);
+        handle = parent;
+    }
+}
+
+// Makes [handle]'s fd usable until unuse_dir_handle(), reopening it when the budget closed it. Returns false when it
+// can't be reopened
+bool use_dir_handle(struct dir_handle *handle)
+{
+    if (handle == &cwd_handle)
+        return true;
+    pthread_mutex_lock(&dir_budget.lock);
+    bool opened = true;
+    while (handle->fd == -1 && opened)
+    {
+        // opened by its path relative to the nearest open parent (or the top), deep trees go through the closed
+        // parents in steps shorter than PATH_MAX
+        struct dir_handle *parent = handle->parent;
+        while (parent && parent->fd == -1)
+            parent = parent->parent;
+        size_t prefix = parent ? parent->path_length + 1 : 0;
+        struct dir_handle *closed = handle;
+        while (closed->path_length - prefix >= PATH_MAX && closed->parent != parent)
+            closed = closed->parent;
+        if (parent)
+            parent->users++;
+        close_idle_dirs(dir_budget.limit - 1);
+        closed->fd = openat(parent ? parent->fd : AT_FDCWD, closed->path + prefix, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (parent)
+            parent->users--;
+        if (closed->fd == -1)
+            opened = false;
+        else
+        {
+            dir_budget.open++;
+            dir_budget.reopened++;
+            link_newest_dir(closed);
+        }
+    }
+    if (opened)
+    {
+        handle->users++;
+        unlink_dir(handle);
+        link_newest_dir(handle);
+    }
+    pthread_mutex_unlock(&dir_budget.lock);
+    return opened;
+}
+
+void unuse_dir_handle(struct dir_handle *handle)
+{
+    if (handle == &cwd_handle)
+        return;
+    pthread_mutex_lock(&dir_budget.lock);
+    handle->users--;
+    close_idle_dirs(dir_budget.limit);
+    pthread_mutex_unlock(&dir_budget.lock);
+}
+
+// Closes the least recently used handles that aren't in use until at most [keep] are open, with the budget lock
+// held. Handles in use stay open, so the budget can be exceeded by them
+void close_idle_dirs(int keep)
+{
+    struct dir_handle *handle = dir_budget.oldest;
+    while (handle != NULL && dir_budget.open > keep)
+    {
+        struct dir_handle *newer = handle->newer;
+        if (handle->users == 0)
+        {
+            close(handle->fd);
+            handle->fd = -1;
+            unlink_dir(handle);
+            dir_budget.open--;
+        }
+        handle = newer;
+    }
+}
+
+void link_newest_dir(struct dir_handle *handle)
+{
+    handle->older = dir_budget.newest;
+    handle->newer = NULL;
+    if (dir_budget.newest)
+        dir_budget.newest->newer = handle;
+    else
+        dir_budget.oldest = handle;
+    dir_budget.newest = handle;
+}
+
+void unlink_dir(struct dir_handle *handle)
+{
+    if (handle->older)
+        handle->older->newer = handle->newer;
+    else
+        dir_budget.oldest = handle->newer;
+    if (handle->newer)
+        handle->newer->older = handle->older;
+    else
+        dir_budget.newest = handle->older;
+}
+
+// Builds dir/name in [buffer], or just name for entries opened by their full path. The result is valid until the
+// buffer is used again on this thread
+char *build_path(struct path_buffer *buffer, const struct dir_handle *dir, const char *name)
+{
+    size_t prefix = dir->path ? dir->path_length + 1 : 0;
+    size_t length = prefix + strlen(name) + 1;
+    if (length > buffer->capacity)
+    {
+        buffer->capacity = length > buffer->capacity * 2 ? length + PATH_BUFFER_SLACK : buffer->capacity * 2;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    if (dir->path)
+    {
+        memcpy(buffer->data, dir->path, dir->path_length);
+        buffer->data[dir->path_length] = '/';
+    }
+    memcpy(buffer->data + prefix, name, length - prefix);
+    return buffer->data;
+}
+
+// The getdents64 buffer for the next directory depth on this thread, kept for the next directory at that depth
+char *acquire_scan_buffer()
+{
+    if (scan_buffers.depth == scan_buffers.count)
+    {
+        scan_buffers.buffers = realloc(scan_buffers.buffers, sizeof(char *) * (scan_buffers.count + 1));
+        scan_buffers.buffers[scan_buffers.count++] = malloc(DIRENT_BATCH_SIZE);
+    }
+    return scan_buffers.buffers[scan_buffers.depth++];
+}
+
+void release_scan_buffer()
+{
+    scan_buffers.depth--;
+}
+
+// Called by each thread that copied entries, before it exits
+void free_thread_buffers()
+{
+    free(source_path_buffer.data);
+    free(destination_path_buffer.data);
+    for (int i = 0; i < scan_buffers.count; i++)
+        free(scan_buffers.buffers[i]);
+    free(scan_buffers.buffers);
+}
+
+// Returns the next entry, reading a new batch when the buffer is used up, or NULL at the end of the directory
+struct dirent64 *next_dir_entry(struct dir_scanner *scanner)
+{
+    if (scanner->position >= scanner->length)
+    {
+        unsigned long long timer = start_timer();
+        scanner->length = scanner->buffer ? getdents64(scanner->fd, scanner->buffer, DIRENT_BATCH_SIZE) : -1;
+        stop_timer(PHASE_SCAN, timer);
+        scanner->position = 0;
+        if (scanner->length == -1)
+            perror("Failed to read source directory");
+        if (scanner->length <= 0)
+            return NULL;
+    }
+    struct dirent64 *entry = (struct dirent64 *)(scanner->buffer + scanner->position);
+    scanner->position += entry->d_reclen;
+    return entry;
+}
+
+// Takes the type from d_type, only filesystems that don't fill it (and symlinks with --symlinks=follow) cost a statx
+enum source_type get_entry_type(int dir_fd, const struct dirent64 *entry)
+{
+    if (entry->d_type == DT_REG)
+        return F;
+    if (entry->d_type == DT_DIR)
+        return D;
+    bool follow = follow_links(false);
+    if (entry->d_type == DT_LNK && !follow)
+        return L;
+    if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK)
+        return NOT_EXIST;
+
+    struct statx entry_state;
+    unsigned long long timer = start_timer();
+    int result = statx(dir_fd, entry->d_name, AT_NO_AUTOMOUNT | (follow ? 0 : AT_SYMLINK_NOFOLLOW), STATX_TYPE, &entry_state);
+    stop_timer(PHASE_STAT, timer);
+    if (result != 0)
+        return NOT_EXIST;
+    if (S_ISREG(entry_state.stx_mode))
+        return F;
+    if (S_ISDIR(entry_state.stx_mode))
+        return D;
+    if (S_ISLNK(entry_state.stx_mode))
+        return L;
+    return NOT_EXIST;
+}
+
+// One traversal step: copies a file, or creates a directory, copies its files and queues its subdirectories
+void run_task(struct task *task)
+{
+    // tasks queued before --on-conflict=fail stopped the copy are dropped
+    if (!__atomic_load_n(&conflict_stop, __ATOMIC_RELAXED))
+    {
+        if (!use_dir_handle(task->source_dir))
+            perror("Failed to reopen source directory");
+        else if (!use_dir_handle(task->destination_dir))
+        {
+            perror("Failed to reopen destination directory");
+            unuse_dir_handle(task->source_dir);
+        }
+        else
+        {
+            if (task->type == F)
+                copy_file(task->source_dir, task->source_name, task->destination_dir, task->name, task->enable_overwrite_check);
+            else if (task->type == L)
+                copy_symlink(task->source_dir, task->source_name, task->destination_dir, task->name, task->enable_overwrite_check);
+            else
+                copy_directory(task->source_dir, task->source_name, task->destination_dir, task->name, task->enable_overwrite_check);
+            unuse_dir_handle(task->source_dir);
+            unuse_dir_handle(task->destination_dir);
+        }
+    }
+    release_dir_handle(task->source_dir);
+    release_dir_handle(task->destination_dir);
+    free(task);
+}
+
+// Without workers, directories are copied from an explicit stack (depth first), the first push drains it
+void push_serial_task(struct task *task)
+{
+    if (serial_tasks.count == serial_tasks.capacity)
+    {
+        serial_tasks.capacity = serial_tasks.capacity ? serial_tasks.capacity * 2 : 64;
+        serial_tasks.tasks = realloc(serial_tasks.tasks, sizeof(struct task *) * serial_tasks.capacity);
+    }
+    serial_tasks.tasks[serial_tasks.count++] = task;
+    if (serial_tasks.draining)
+        return;
+    serial_tasks.draining = true;
+    while (serial_tasks.count > 0)
+        run_task(serial_tasks.tasks[--serial_tasks.count]);
+    serial_tasks.draining = false;
+}
+
+// Copies a file (or symbolic link) right away, or queues it on the thread pool when --jobs is more than 1.
+// Directories are always queued, on the pool or the serial stack
+void copy_entry(enum source_type type, struct dir_handle *source_dir, const char *source_name, struct dir_handle *destination_dir, const char *name, bool enable_overwrite_check)
+{
+    if (__atomic_load_n(&conflict_stop, __ATOMIC_RELAXED))
+        return;
+    // the step copying the parent directory has both handles in use
+    if (thread_pool.size <= 1 && type == F)
+        copy_file(source_dir, source_name, destination_dir, name, enable_overwrite_check);
+    else if (thread_pool.size <= 1 && type == L)
+        copy_symlink(source_dir, source_name, destination_dir, name, enable_overwrite_check);
+    else
+    {
+        // the task keeps a reference to both directories until it's done, the names are copied into the same allocation
+        size_t source_name_size = strlen(source_name) + 1;
+        bool same_name = !strcmp(source_name, name);
+        struct task *task = malloc(sizeof(struct task) + source_name_size + (same_name ? 0 : strlen(name) + 1));
+        task->type = type;
+        task->source_dir = retain_dir_handle(source_dir);
+        task->source_name = memcpy(task + 1, source_name, source_name_size);
+        task->destination_dir = retain_dir_handle(destination_dir);
+        task->name = same_name ? task->source_name : strcpy(task->source_name + source_name_size, name);
+        task->enable_overwrite_check = enable_overwrite_check;
+        if (thread_pool.size > 1)
+            submit_task(task);
+        else
+            push_serial_task(task);
+    }
+}
+
+// Starts [jobs] workers, or none (copying serially) when threads can't be created
+void start_thread_pool(int jobs)
+{
+    thread_pool.deques = calloc(jobs, sizeof(struct task_deque));
+    thread_pool.threads = malloc(sizeof(pthread_t) * jobs);
+    for (int i = 0; i < jobs; i++)
+        pthread_mutex_init(&thread_pool.deques[i].lock, NULL);
+    thread_pool.deque_count = jobs;
+    // workers steal across [size] deques, so it's set before any of them starts
+    thread_pool.size = jobs;
+    int started = 0;
+    while (started < jobs && pthread_create(&thread_pool.threads[started], NULL, worker_main, (void *)(long)started) == 0)
+        started++;
+    if (started < jobs)
+    {
+        printf("Failed to start copy threads, copying serially.\n\n");
+        stop_thread_pool(started);
+    }
+}
+
+// Waits for every queued task (and the tasks they queue) to finish, then joins [started] workers
+void stop_thread_pool(int started)
+{
+    pthread_mutex_lock(&thread_pool.idle_lock);
+    while (__atomic_load_n(&thread_pool.pending, __ATOMIC_ACQUIRE) > 0 && started > 0)
+        pthread_cond_wait(&thread_pool.all_done, &thread_pool.idle_lock);
+    thread_pool.stopping = true;
+    pthread_cond_broadcast(&thread_pool.work_available);
+    pthread_mutex_unlock(&thread_pool.idle_lock);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(thread_pool.threads[i], NULL);
+    // a pool without workers copies serially from now on
+    thread_pool.size = 1;
+    for (int i = 0; i < thread_pool.deque_count; i++)
+    {
+        pthread_mutex_destroy(&thread_pool.deques[i].lock);
+        free(thread_pool.deques[i].tasks);
+    }
+    free(thread_pool.deques);
+    free(thread_pool.threads);
+    thread_pool.deques = NULL;
+    thread_pool.threads = NULL;
+}
+
+// Workers push to and pop from the bottom of their own deque (depth first, like the serial recursion),
+// idle workers steal the oldest task from the top of another one
+void submit_task(struct task *task)
+{
+    struct task_deque *deque = &thread_pool.deques[worker_index >= 0 ? worker_index : thread_pool.next_deque++ % thread_pool.size];
+    // counted before another worker can take it, so the counts can't reach zero while its parent still runs
+    __atomic_add_fetch(&thread_pool.pending, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&thread_pool.queued, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom - deque->top == deque->capacity)
+    {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+        struct task **tasks = malloc(sizeof(struct task *) * capacity);
+        for (size_t i = deque->top; i < deque->bottom; i++)
+            tasks[i - deque->top] = deque->tasks[i % deque->capacity];
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->bottom -= deque->top;
+        deque->top = 0;
+        deque->capacity = capacity;
+    }
+    deque->tasks[deque->bottom++ % deque->capacity] = task;
+    pthread_mutex_unlock(&deque->lock);
+
+    pthread_mutex_lock(&thread_pool.idle_lock);
+    pthread_cond_signal(&thread_pool.work_available);
+    pthread_mutex_unlock(&thread_pool.idle_lock);
+}
+
+struct task *take_task(int index)
+{
+    struct task *task = NULL;
+    for (int i = 0; i < thread_pool.size && !task; i++)
+    {
+        struct task_deque *deque = &thread_pool.deques[(index + i) % thread_pool.size];
+        pthread_mutex_lock(&deque->lock);
+        if (deque->bottom != deque->top)
+        {
+            if (i == 0)
+                task = deque->tasks[--deque->bottom % deque->capacity];
+            else
+                task = deque->tasks[deque->top++ % deque->capacity];
+        }
+        pthread_mutex_unlock(&deque->lock);
+    }
+    if (task)
+        __atomic_sub_fetch(&thread_pool.queued, 1, __ATOMIC_RELEASE);
+    return task;
+}
+
+void *worker_main(void *arg)
+{
+    worker_index = (int)(long)arg;
+    while (true)
+    {
+        struct task *task = take_task(worker_index);
+        if (task)
+        {
+            run_task(task);
+            if (__atomic_sub_fetch(&thread_pool.pending, 1, __ATOMIC_ACQ_REL) == 0)
+            {
+                pthread_mutex_lock(&thread_pool.idle_lock);
+                pthread_cond_broadcast(&thread_pool.all_done);
+                pthread_mutex_unlock(&thread_pool.idle_lock);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&thread_pool.idle_lock);
+        while (__atomic_load_n(&thread_pool.queued, __ATOMIC_ACQUIRE) == 0 && !thread_pool.stopping)
+            pthread_cond_wait(&thread_pool.work_available, &thread_pool.idle_lock);
+        bool stop = thread_pool.stopping;
+        pthread_mutex_unlock(&thread_pool.idle_lock);
+        if (stop)
+            break;
+    }
+    close_io_uring();
+    free_thread_buffers();
+    return NULL;
+}
+
+void remove_last_slash(char **path)
+{
+    int len = strlen(*path);
+    if (len > 1 && (*path)[len - 1] == '/')
+    {
+        (*path)[len - 1] = '\0';
+    }
+}
+
+void decode_source_path(const char *path, char **name, char **true_path)
+{
+    char *r_path = resolve_source_path(path);
+    int len = strlen(path);
+    char *colon = strrchr(path, ':');
+    char *last_slash = strrchr(path, '/');
+
+    // realpath's buffer is handed over instead of copied
+    if (r_path)
+    {
+        *name = strdup(strrchr(r_path, '/') + 1);
+        *true_path = r_path;
+    }
+    else if (colon && colon > last_slash && path[len - 1] != ':')
+    {
+        *name = strdup(colon + 1);
+        char *tmp = strndup(path, colon - path);
+        r_path = resolve_source_path(tmp);
+        if (r_path)
+        {
+            *true_path = r_path;
+            free(tmp);
+        }
+        else
+            *true_path = tmp;
+    }
+    else
+    {
+        *true_path = strdup(path);
+        *name = strdup(last_slash ? last_slash + 1 : path);
+    }
+}
+
+// realpath() of a source, except for a symbolic link that isn't followed: only the directory holding it is resolved,
+// so the link keeps its name
+char *resolve_source_path(const char *path)
+{
+    struct stat state;
+    if (follow_links(true) || lstat(path, &state) == -1 || !S_ISLNK(state.st_mode))
+        return realpath(path, NULL);
+    const char *last_slash = strrchr(path, '/');
+    char *directory = last_slash == NULL ? strdup(".") : last_slash == path ? strdup("/") : strndup(path, last_slash - path);
+    char *resolved = realpath(directory, NULL);
+    free(directory);
+    if (resolved == NULL)
+        return NULL;
+    const char *link_name = last_slash ? last_slash + 1 : path;
+    char *link_path = malloc(strlen(resolved) + strlen(link_name) + 2);
+    sprintf(link_path, "%s%s%s", resolved, strcmp(resolved, "/") ? "/" : "", link_name);
+    free(resolved);
+    return link_path;
+}
+
+bool create_directories_recursively(const char *path)
+{
+    enum source_type type = get_source_type(path);
+
+    if (type == D)
+        return true;
+
+    if (type == F)
+    {
+        printf("Path %s is a file, choose a different path.\n\n", path);
+        return false;
+    }
+
+    char response = 'y';
+    if (isatty(STDIN_FILENO))
+    {
+        printf("Destination directory %s does not exist.\nWant to create it (y/n)? : ", path);
+        response = read_char();
+        NL;
+    }
+    else
+        printf("Creating destination directory %s.\n", path);
+    if (response != 'y')
+    {
+        printf("Directory creation aborted. Exiting.\n\n");
+        return false;
+    }
+
+    int len = strlen(path), i = 0;
+    char *tmp_path = malloc(len + 1);
+    tmp_path[len] = '\0';
+
+    if (path[0] == '/')
+    {
+        i = 1;
+        tmp_path[0] = '/';
+    }
+
+    for (; i < len; i++)
+    {
+        if (path[i] == '/')
+        {
+            tmp_path[i] = '\0';
+            if (!make_dir(tmp_path))
+            {
+                free(tmp_path);
+                return false;
+            }
+        }
+        tmp_path[i] = path[i];
+
+        if (i == len - 1)
+        {
+            if (!make_dir(tmp_path))
+            {
+                free(tmp_path);
+                return false;
+            }
+        }
+    }
+    free(tmp_path);
+    return true;
+}
+
+// Adds the source at [path] and everything under it to the manifest, following symlinks like the copy does. The
+// directories are scanned one at a time from an explicit stack, with their handles in the --open-dirs budget like
+// the copy's, so deep trees cost neither C stack nor open files
+void plan_source(const char *path)
+{
+    plan_entry(&cwd_handle, path, NO_PARENT);
+    while (manifest.step_count > 0)
+    {
+        struct plan_step step = manifest.steps[--manifest.step_count];
+        plan_directory(step.parent, step.index);
+        release_dir_handle(step.parent);
+    }
+}
+
+// Adds [name] in [dir], which is in use, to the manifest. Directories are queued to be scanned. Links that are
+// recreated hold no data and aren't counted
+void plan_entry(struct dir_handle *dir, const char *name, unsigned parent)
+{
+    struct statx state;
+    int flags = AT_NO_AUTOMOUNT | (follow_links(parent == NO_PARENT) ? 0 : AT_SYMLINK_NOFOLLOW);
+    if (statx(dir->fd, name, flags, STATX_TYPE | STATX_SIZE | STATX_BLOCKS | STATX_INO | STATX_NLINK, &state) != 0)
+    {
+        printf("%sFailed to scan %s: %s\n", clear_line, build_path(&source_path_buffer, dir, name), strerror(errno));
+        manifest.errors++;
+        return;
+    }
+    enum source_type type = S_ISREG(state.stx_mode) ? F : S_ISDIR(state.stx_mode) ? D : NOT_EXIST;
+    if (type == NOT_EXIST)
+        return;
+    dev_t device = makedev(state.stx_dev_major, state.stx_dev_minor);
+    // a directory reached again through a link to one of its parents, the copy skips it too
+    for (unsigned i = parent; type == D && symlink_mode == SYMLINKS_FOLLOW && i != NO_PARENT; i = manifest.entries[i].parent)
+    {
+        if (manifest.entries[i].device == device && manifest.entries[i].inode == state.stx_ino)
+            return;
+    }
+
+    if (manifest.count == manifest.capacity)
+    {
+        manifest.capacity = manifest.capacity ? manifest.capacity * 2 : 1024;
+        manifest.entries = realloc(manifest.entries, sizeof(struct manifest_entry) * manifest.capacity);
+    }
+    size_t name_length = strlen(name) + 1;
+    if (manifest.names_length + name_length > manifest.names_capacity)
+    {
+        while (manifest.names_length + name_length > manifest.names_capacity)
+            manifest.names_capacity = manifest.names_capacity ? manifest.names_capacity * 2 : 64 * 1024;
+        manifest.names = realloc(manifest.names, manifest.names_capacity);
+    }
+    unsigned index = manifest.count++;
+    struct manifest_entry *entry = &manifest.entries[index];
+    entry->parent = parent;
+    entry->name = manifest.names_length;
+    entry->type = type;
+    entry->size = state.stx_size;
+    entry->device = device;
+    entry->inode = state.stx_ino;
+    memcpy(manifest.names + manifest.names_length, name, name_length);
+    manifest.names_length += name_length;
+
+    if (type == F)
+    {
+        manifest.file_count++;
+        manifest.total_bytes += state.stx_size;
+        // sparse files only need their data blocks at the destination
+        off_t allocated = state.stx_blocks * 512;
+        off_t needed = sparse_mode == SPARSE_AUTO && allocated < (off_t)state.stx_size ? allocated : (off_t)state.stx_size;
+        manifest.needed_bytes += needed;
+        // later names of the inode are linked to the first copy, count_linked_names() takes them out again. Like
+        // the copy, a followed symbolic link isn't one of the names
+        struct stat link_state;
+        if (preserve_links && state.stx_nlink > 1 &&
+            (symlink_mode == SYMLINKS_COPY || (fstatat(dir->fd, name, &link_state, AT_SYMLINK_NOFOLLOW) == 0 && !S_ISLNK(link_state.st_mode))))
+        {
+            if (manifest.link_count == manifest.link_capacity)
+            {
+                manifest.link_capacity = manifest.link_capacity ? manifest.link_capacity * 2 : 256;
+                manifest.links = realloc(manifest.links, sizeof(struct manifest_link) * manifest.link_capacity);
+            }
+            manifest.links[manifest.link_count++] = (struct manifest_link){device, state.stx_ino, needed};
+        }
+        return;
+    }
+
+    manifest.directory_count++;
+    if (manifest.step_count == manifest.step_capacity)
+    {
+        manifest.step_capacity = manifest.step_capacity ? manifest.step_capacity * 2 : 64;
+        manifest.steps = realloc(manifest.steps, sizeof(struct plan_step) * manifest.step_capacity);
+    }
+    manifest.steps[manifest.step_count++] = (struct plan_step){retain_dir_handle(dir), index};
+}
 
-    // used [destination_dir[source_len] == '/']
-    // cuz it might be like from : /home/user/dir1 to /home/user/dir123
-    if (dest_len > source_len && !strncmp(source_dir, destination_dir, source_len) && destination_dir[source_len] == '/')
+// Scans the directory of manifest entry [index] inside [parent]
+void plan_directory(struct dir_handle *parent, unsigned index)
+{
+    const char *name = manifest.names + manifest.entries[index].name;
+    char *path = build_path(&source_path_buffer, parent, name);
+    if (!use_dir_handle(parent))
+    {
+        printf("%sFailed to reopen the directory of %s: %s\n", clear_line, path, strerror(errno));
+        manifest.errors++;
+        return;
+    }
+    struct dir_handle *dir = open_dir_handle(parent, name, path);
+    unuse_dir_handle(parent);
+    if (dir == NULL)
+    {
+        printf("%sFailed to scan %s: %s\n", clear_line, path, strerror(errno));
+        manifest.errors++;
+        return;
+    }
+    struct dir_scanner scanner = {dir->fd, acquire_scan_buffer(), 0, 0};
+    struct dirent64 *dir_entry;
+    while ((dir_entry = next_dir_entry(&scanner)) != NULL)
+    {
+        if (strcmp(dir_entry->d_name, ".") && strcmp(dir_entry->d_name, ".."))
+            plan_entry(dir, dir_entry->d_name, index);
+    }
+    // next_dir_entry() reported the error
+    if (scanner.length == -1)
+        manifest.errors++;
+    release_scan_buffer();
+    unuse_dir_handle(dir);
+    release_dir_handle(dir);
+}
+
+// Takes the later names of each hard-linked inode out of the bytes to write, they're linked to the first copy
+void count_linked_names()
+{
+    qsort(manifest.links, manifest.link_count, sizeof(struct manifest_link), compare_manifest_links);
+    for (size_t i = 1; i < manifest.link_count; i++)
+    {
+        if (manifest.links[i].device == manifest.links[i - 1].device && manifest.links[i].inode == manifest.links[i - 1].inode)
+        {
+            manifest.needed_bytes -= manifest.links[i].needed_bytes;
+            manifest.linked_count++;
+        }
+    }
+}
+
+int compare_manifest_links(const void *a, const void *b)
+{
+    const struct manifest_link *first = a, *second = b;
+    if (first->device != second->device)
+        return first->device < second->device ? -1 : 1;
+    if (first->inode != second->inode)
+        return first->inode < second->inode ? -1 : 1;
+    return 0;
+}
+
+// Prints the totals of the manifest, returns false when they can't fit in the destination filesystem
+bool check_plan(const char *destination)
+{
+    char total[32], needed[32], available[32];
+    format_size(manifest.total_bytes, total);
+    format_size(manifest.needed_bytes, needed);
+    if (manifest.linked_count > 0)
+        printf("Plan: %zu files (%zu hard links), %zu directories, %s of data (%s to write).\n", manifest.file_count, manifest.linked_count, manifest.directory_count, total, needed);
+    else
+        printf("Plan: %zu files, %zu directories, %s of data (%s to write).\n", manifest.file_count, manifest.directory_count, total, needed);
+    // a partial scan would pass the checks below with totals that are too low
+    if (manifest.errors > 0)
+    {
+        printf("Plan incomplete: %zu %s couldn't be scanned.\n\n", manifest.errors, manifest.errors == 1 ? "entry" : "entries");
+        return false;
+    }
+
+    struct statvfs destination_state;
+    if (statvfs(destination, &destination_state) != 0)
+    {
+        perror("Failed to check destination free space");
+        return false;
+    }
+    off_t free_bytes = (off_t)destination_state.f_bavail * destination_state.f_frsize;
+    format_size(free_bytes, available);
+    printf("Destination %s has %s free.\n\n", destination, available);
+
+    // files that would be overwritten aren't subtracted, so this errs on the safe side
+    if (manifest.needed_bytes > free_bytes)
+    {
+        printf("Not enough space in %s: %s needed, %s available.\n\n", destination, needed, available);
+        return false;
+    }
+    // filesystems without an inode limit report 0 files
+    size_t inodes = manifest.file_count - manifest.linked_count + manifest.directory_count;
+    if (destination_state.f_files > 0 && inodes > destination_state.f_favail)
+    {
+        printf("Not enough inodes in %s: %zu needed, %lu available.\n\n", destination, inodes, (unsigned long)destination_state.f_favail);
+        return false;
+    }
+    return true;
+}
+
+void free_manifest()
+{
+    free(manifest.entries);
+    free(manifest.names);
+    free(manifest.links);
+    free(manifest.steps);
+    memset(&manifest, 0, sizeof(manifest));
+}
+
+// 1536 => "1.5 KB"
+void format_size(off_t bytes, char *buffer)
+{
+    const char *units[] = {"B", "KB", "MB", "GB", "TB", "PB"};
+    double size = bytes;
+    int unit = 0;
+    while (size >= 1024 && unit < 5)
+    {
+        size /= 1024;
+        unit++;
+    }
+    if (unit == 0)
+        sprintf(buffer, "%lld B", (long long)bytes);
+    else
+        sprintf(buffer, "%.1f %s", size, units[unit]);
+}
+
+// 0 when --stats is off, so the hot paths don't pay for the clock
+unsigned long long start_timer()
+{
+    if (stats_mode == STATS_NONE)
+        return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Counts one call of the phase and its time, returns the nanoseconds since [start]
+unsigned long long stop_timer(enum stats_phase phase, unsigned long long start)
+{
+    if (stats_mode == STATS_NONE)
+        return 0;
+    unsigned long long elapsed = start_timer() - start;
+    __atomic_add_fetch(&stats.calls[phase], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.nanoseconds[phase], elapsed, __ATOMIC_RELAXED);
+    return elapsed;
+}
+
+// [engine] is ENGINE_COUNT for files that failed, [start] is when the file was opened (prompts excluded)
+void record_file(const char *path, enum copy_engine engine, off_t bytes, unsigned long long start)
+{
+    if (stats_mode == STATS_NONE)
+        return;
+    if (engine == ENGINE_COUNT)
+    {
+        __atomic_add_fetch(&stats.failed_files, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    unsigned long long elapsed = start_timer() - start;
+    __atomic_add_fetch(&stats.files, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.engines[engine], 1, __ATOMIC_RELAXED);
+
+    // bucket 0: under 1 µs, bucket i: under 2^i µs
+    unsigned long long microseconds = elapsed / 1000;
+    int bucket = microseconds == 0 ? 0 : 64 - __builtin_clzll(microseconds);
+    if (bucket >= LATENCY_BUCKETS)
+        bucket = LATENCY_BUCKETS - 1;
+    __atomic_add_fetch(&stats.latency[bucket], 1, __ATOMIC_RELAXED);
+
+    // the list is sorted slowest first, most files are faster than the last one and skip the lock
+    if (elapsed <= __atomic_load_n(&stats.slowest[SLOWEST_FILES - 1].nanoseconds, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&stats.slowest_lock);
+    int i = SLOWEST_FILES - 1;
+    if (elapsed > stats.slowest[i].nanoseconds)
+    {
+        free(stats.slowest[i].path);
+        for (; i > 0 && elapsed > stats.slowest[i - 1].nanoseconds; i--)
+        {
+            stats.slowest[i].path = stats.slowest[i - 1].path;
+            __atomic_store_n(&stats.slowest[i].nanoseconds, stats.slowest[i - 1].nanoseconds, __ATOMIC_RELAXED);
+        }
+        stats.slowest[i].path = strdup(path);
+        __atomic_store_n(&stats.slowest[i].nanoseconds, elapsed, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stats.slowest_lock);
+}
+
+// Printed to stderr so the report stays separate from the per-file output
+void print_stats(unsigned long long elapsed)
+{
+    double seconds = elapsed / 1e9;
+    if (stats_mode == STATS_JSON)
+    {
+        fprintf(stderr, "{\"seconds\": %.6f, \"files\": %llu, \"failed_files\": %llu, \"skipped_files\": %llu, \"unchanged_files\": %llu, \"linked_files\": %llu, \"symlinks\": %llu, \"deduplicated_files\": %llu, \"deduplicated_bytes\": %llu, \"directories\": %llu, \"reopened_directories\": %llu, \"bytes\": %llu, \"phases\": {",
+                seconds, stats.files, stats.failed_files, stats.skipped_files, stats.unchanged_files, stats.linked_files, stats.symlinks, dedup_savings.files, dedup_savings.bytes, stats.directories, dir_budget.reopened, stats.bytes);
+        for (int i = 0; i < PHASE_COUNT; i++)
+            fprintf(stderr, "%s\"%s\": {\"calls\": %llu, \"seconds\": %.6f}", i ? ", " : "", phase_names[i], stats.calls[i], stats.nanoseconds[i] / 1e9);
+        fprintf(stderr, "}, \"engines\": {");
+        for (int i = 0; i < ENGINE_COUNT; i++)
+            fprintf(stderr, "%s\"%s\": %llu", i ? ", " : "", engine_names[i], stats.engines[i]);
+        fprintf(stderr, "}, \"file_latency\": [");
+        // the last bucket has no upper bound
+        for (int i = 0; i < LATENCY_BUCKETS - 1; i++)
+            fprintf(stderr, "{\"below_us\": %llu, \"files\": %llu}, ", 1ULL << i, stats.latency[i]);
+        fprintf(stderr, "{\"below_us\": null, \"files\": %llu}", stats.latency[LATENCY_BUCKETS - 1]);
+        fprintf(stderr, "], \"slowest_files\": [");
+        for (int i = 0; i < SLOWEST_FILES && stats.slowest[i].path; i++)
+        {
+            fprintf(stderr, "%s{\"path\": ", i ? ", " : "");
+            print_json_string(stats.slowest[i].path);
+            fprintf(stderr, ", \"seconds\": %.6f}", stats.slowest[i].nanoseconds / 1e9);
+        }
+        fprintf(stderr, "]}\n");
+        return;
+    }
+
+    char bytes[32], rate[32];
+    format_size(stats.bytes, bytes);
+    format_size(seconds > 0 ? stats.bytes / seconds : 0, rate);
+    fprintf(stderr, "\nStats: %llu files (%llu failed, %llu skipped, %llu unchanged, %llu hard links, %llu symbolic links, %llu deduplicated), %llu directories (%llu reopened), %s in %.3f s (%s/s, %.0f files/s)\n",
+            stats.files, stats.failed_files, stats.skipped_files, stats.unchanged_files, stats.linked_files, stats.symlinks, dedup_savings.files, stats.directories, dir_budget.reopened, bytes, seconds, rate, seconds > 0 ? stats.files / seconds : 0);
+    fprintf(stderr, "\n  %-8s %12s %12s %12s\n", "phase", "calls", "seconds", "avg us");
+    for (int i = 0; i < PHASE_COUNT; i++)
+        fprintf(stderr, "  %-8s %12llu %12.3f %12.1f\n", phase_names[i], stats.calls[i], stats.nanoseconds[i] / 1e9,
+                stats.calls[i] ? stats.nanoseconds[i] / 1e3 / stats.calls[i] : 0);
+    fprintf(stderr, "\n  engines:");
+    for (int i = 0; i < ENGINE_COUNT; i++)
+        if (stats.engines[i])
+            fprintf(stderr, " %s %llu", engine_names[i], stats.engines[i]);
+    fprintf(stderr, "\n\n  file latency:\n");
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        if (stats.latency[i] == 0)
+            continue;
+        if (i == LATENCY_BUCKETS - 1)
+            fprintf(stderr, "    >= %9llu us %10llu\n", 1ULL << (i - 1), stats.latency[i]);
+        else
+            fprintf(stderr, "    <  %9llu us %10llu\n", 1ULL << i, stats.latency[i]);
+    }
+    if (stats.slowest[0].path)
+        fprintf(stderr, "\n  slowest files:\n");
+    for (int i = 0; i < SLOWEST_FILES && stats.slowest[i].path; i++)
+        fprintf(stderr, "    %10.6f s  %s\n", stats.slowest[i].nanoseconds / 1e9, stats.slowest[i].path);
+}
+
+void print_json_string(const char *text)
+{
+    fputc('"', stderr);
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            fprintf(stderr, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(stderr, "\\u%04x", *c);
+        else
+            fputc(*c, stderr);
+    }
+    fputc('"', stderr);
+}
+
+void free_stats()
+{
+    for (int i = 0; i < SLOWEST_FILES; i++)
+        free(stats.slowest[i].path);
+}
+
+// Called by the copy loops for every block that reaches the destination
+void add_progress(off_t bytes)
+{
+    if (progress_mode != PROGRESS_NONE)
+        __atomic_add_fetch(&progress.bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void start_progress()
+{
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&progress.stopped, &attributes);
+    pthread_condattr_destroy(&attributes);
+    if (pthread_create(&progress.thread, NULL, progress_main, NULL) != 0)
     {
-        printf("Cannot copy parent directory (%s) into its child (%s). Skipping copy.\n\n", source_dir, destination_dir);
+        perror("Failed to start progress thread");
+        progress_mode = PROGRESS_NONE;
+    }
+}
+
+void stop_progress()
+{
+    if (progress_mode == PROGRESS_NONE)
         return;
+    pthread_mutex_lock(&progress.lock);
+    progress.stopping = true;
+    pthread_cond_signal(&progress.stopped);
+    pthread_mutex_unlock(&progress.lock);
+    pthread_join(progress.thread, NULL);
+    pthread_cond_destroy(&progress.stopped);
+}
+
+// Wakes up every interval and prints the counters, the current rate is smoothed over the last few intervals
+void *progress_main(void *arg)
+{
+    (void)arg;
+    long interval = progress_mode == PROGRESS_TTY ? PROGRESS_TTY_INTERVAL : PROGRESS_LINE_INTERVAL;
+    struct timespec start, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = start;
+    off_t last_bytes = 0;
+    double last_elapsed = 0, rate = -1;
+
+    pthread_mutex_lock(&progress.lock);
+    while (!progress.stopping)
+    {
+        deadline.tv_sec += (deadline.tv_nsec + interval * 1000000) / 1000000000;
+        deadline.tv_nsec = (deadline.tv_nsec + interval * 1000000) % 1000000000;
+        while (!progress.stopping && pthread_cond_timedwait(&progress.stopped, &progress.lock, &deadline) != ETIMEDOUT)
+            ;
+        if (progress.stopping)
+            break;
+
+        double elapsed = (deadline.tv_sec - start.tv_sec) + (deadline.tv_nsec - start.tv_nsec) / 1e9;
+        off_t bytes = __atomic_load_n(&progress.bytes, __ATOMIC_RELAXED);
+        double sample = (bytes - last_bytes) / (elapsed - last_elapsed);
+        rate = rate < 0 ? sample : 0.7 * rate + 0.3 * sample;
+        last_bytes = bytes;
+        last_elapsed = elapsed;
+        // don't draw over an overwrite/rename question
+        if (pthread_mutex_trylock(&prompt_lock) == 0)
+        {
+            print_progress(elapsed, rate, false);
+            pthread_mutex_unlock(&prompt_lock);
+        }
+    }
+    pthread_mutex_unlock(&progress.lock);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    print_progress(elapsed, elapsed > 0 ? __atomic_load_n(&progress.bytes, __ATOMIC_RELAXED) / elapsed : 0, true);
+    return NULL;
+}
+
+// "1.2 GB / 10.0 GB (12%), 1234 / 20000 files, 850 files/s, 512.0 MB/s, ETA 0:00:17"
+void print_progress(double elapsed, double rate, bool final)
+{
+    off_t bytes = __atomic_load_n(&progress.bytes, __ATOMIC_RELAXED);
+    long files = __atomic_load_n(&progress.files, __ATOMIC_RELAXED);
+    // clones and sparse files can count more than the scan expected
+    off_t total = progress.total_bytes > bytes ? progress.total_bytes : bytes;
+    char done_size[32], total_size[32], rate_size[32], eta[32];
+    format_size(bytes, done_size);
+    format_size(total, total_size);
+    format_size(rate, rate_size);
+    // the final line shows the total time instead of the ETA
+    long seconds = final ? (long)elapsed : bytes == total ? 0 : rate >= 1 ? (long)((total - bytes) / rate) : -1;
+    if (seconds < 0)
+        strcpy(eta, "--:--:--");
+    else
+        sprintf(eta, "%ld:%02ld:%02ld", seconds / 3600, seconds / 60 % 60, seconds % 60);
+
+    char line[256];
+    snprintf(line, sizeof(line), "%s / %s (%d%%), %ld / %ld files, %.0f files/s, %s/s, %s %s",
+             done_size, total_size, total > 0 ? (int)(bytes * 100 / total) : 100, files, progress.total_files,
+             elapsed > 0 ? files / elapsed : 0, rate_size, final ? "done in" : "ETA", eta);
+    if (progress_mode == PROGRESS_TTY)
+        fprintf(stderr, "\r\033[K%s%s", line, final ? "\n" : "\r");
+    else
+        fprintf(stderr, "Progress: %s\n", line);
+}
+
+// --update: the destination is a regular file of the same size that isn't older than the source, or with
+// --update=hash has the same content. Only stats the two files in the first case
+bool is_unchanged(int source_dir_fd, const char *source_name, int destination_dir_fd, const char *destination_name, off_t *size)
+{
+    struct stat source_state, destination_state;
+    unsigned long long timer = start_timer();
+    bool same_size = fstatat(source_dir_fd, source_name, &source_state, 0) == 0 &&
+                     fstatat(destination_dir_fd, destination_name, &destination_state, 0) == 0 &&
+                     S_ISREG(destination_state.st_mode) && source_state.st_size == destination_state.st_size;
+    stop_timer(PHASE_STAT, timer);
+    if (!same_size)
+        return false;
+    *size = source_state.st_size;
+    if (update_mode == UPDATE_TIME)
+        return destination_state.st_mtim.tv_sec > source_state.st_mtim.tv_sec ||
+               (destination_state.st_mtim.tv_sec == source_state.st_mtim.tv_sec && destination_state.st_mtim.tv_nsec >= source_state.st_mtim.tv_nsec);
+
+    int source_file = openat(source_dir_fd, source_name, O_RDONLY);
+    int destination_file = openat(destination_dir_fd, destination_name, O_RDONLY);
+    unsigned long long source_hash, destination_hash;
+    bool same_content = source_file != -1 && destination_file != -1 &&
+                        hash_file(source_file, source_state.st_size, &source_hash) &&
+                        hash_file(destination_file, destination_state.st_size, &destination_hash) &&
+                        source_hash == destination_hash;
+    if (source_file != -1)
+        close(source_file);
+    if (destination_file != -1)
+        close(destination_file);
+    return same_content;
+}
+
+// XXH64 of the whole file, read through a pooled buffer
+bool hash_file(int fd, off_t size, unsigned long long *hash)
+{
+    struct copy_buffer *buffer = acquire_buffer(size);
+    if (buffer == NULL)
+        return false;
+    struct hash_state state;
+    hash_init(&state);
+    ssize_t bytes;
+    while ((bytes = read(fd, buffer->data, buffer->size)) > 0)
+        hash_update(&state, buffer->data, bytes);
+    release_buffer(buffer);
+    if (bytes == -1)
+    {
+        perror("Failed to read file for hashing");
+        return false;
+    }
+    *hash = hash_final(&state);
+    return true;
+}
+
+unsigned long long hash_round(unsigned long long accumulator, unsigned long long input)
+{
+    accumulator += input * HASH_PRIME_2;
+    accumulator = (accumulator << 31) | (accumulator >> 33);
+    return accumulator * HASH_PRIME_1;
+}
+
+unsigned long long hash_merge(unsigned long long hash, unsigned long long accumulator)
+{
+    hash ^= hash_round(0, accumulator);
+    return hash * HASH_PRIME_1 + HASH_PRIME_4;
+}
+
+unsigned long long read_u64(const unsigned char *data)
+{
+    unsigned long long value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+void hash_init(struct hash_state *state)
+{
+    state->accumulators[0] = HASH_PRIME_1 + HASH_PRIME_2;
+    state->accumulators[1] = HASH_PRIME_2;
+    state->accumulators[2] = 0;
+    state->accumulators[3] = -HASH_PRIME_1;
+    state->length = 0;
+    state->buffered = 0;
+}
+
+// Consumes 32-byte stripes, keeping a partial stripe for the next call
+void hash_update(struct hash_state *state, const void *input, size_t length)
+{
+    const unsigned char *data = input;
+    state->length += length;
+    if (state->buffered > 0)
+    {
+        size_t needed = 32 - state->buffered;
+        if (length < needed)
+        {
+            memcpy(state->buffer + state->buffered, data, length);
+            state->buffered += length;
+            return;
+        }
+        memcpy(state->buffer + state->buffered, data, needed);
+        for (int i = 0; i < 4; i++)
+            state->accumulators[i] = hash_round(state->accumulators[i], read_u64(state->buffer + i * 8));
+        data += needed;
+        length -= needed;
+        state->buffered = 0;
+    }
+    for (; length >= 32; data += 32, length -= 32)
+        for (int i = 0; i < 4; i++)
+            state->accumulators[i] = hash_round(state->accumulators[i], read_u64(data + i * 8));
+    memcpy(state->buffer, data, length);
+    state->buffered = length;
+}
+
+unsigned long long hash_final(const struct hash_state *state)
+{
+    const unsigned long long *v = state->accumulators;
+    unsigned long long hash;
+    if (state->length >= 32)
+    {
+        hash = ((v[0] << 1) | (v[0] >> 63)) + ((v[1] << 7) | (v[1] >> 57)) + ((v[2] << 12) | (v[2] >> 52)) + ((v[3] << 18) | (v[3] >> 46));
+        for (int i = 0; i < 4; i++)
+            hash = hash_merge(hash, v[i]);
+    }
+    else
+        hash = HASH_PRIME_5;
+    hash += state->length;
+
+    const unsigned char *data = state->buffer;
+    size_t length = state->buffered;
+    for (; length >= 8; data += 8, length -= 8)
+    {
+        hash ^= hash_round(0, read_u64(data));
+        hash = ((hash << 27) | (hash >> 37)) * HASH_PRIME_1 + HASH_PRIME_4;
+    }
+    if (length >= 4)
+    {
+        unsigned int word;
+        memcpy(&word, data, sizeof(word));
+        hash ^= word * HASH_PRIME_1;
+        hash = ((hash << 23) | (hash >> 41)) * HASH_PRIME_2 + HASH_PRIME_3;
+        data += 4;
+        length -= 4;
+    }
+    for (; length > 0; data++, length--)
+    {
+        hash ^= *data * HASH_PRIME_5;
+        hash = ((hash << 11) | (hash >> 53)) * HASH_PRIME_1;
+    }
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME_2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Feeds the zeros of a sparse file's hole to the copy hash, holes read back as zeros
+void hash_zeros(off_t length)
+{
+    static const char zeros[64 * 1024];
+    for (; length > 0; length -= length < (off_t)sizeof(zeros) ? length : (off_t)sizeof(zeros))
+        hash_update(copy_hash, zeros, length < (off_t)sizeof(zeros) ? length : (off_t)sizeof(zeros));
+}
+
+// --checksums: one "<hash>  <path relative to the checksum file>" line per file, the format of xxhsum -H1
+void write_checksum(const char *destination_path, unsigned long long hash)
+{
+    pthread_mutex_lock(&checksum_lock);
+    fprintf(checksum_file, "%016llx  %s%s\n", hash, checksum_prefix, destination_path + checksum_root_length);
+    pthread_mutex_unlock(&checksum_lock);
+}
+
+// The relative path from directory [from] to directory [to], both absolute without "." or "..", with a trailing
+// slash: "../dst/" from /tmp/sums to /tmp/dst, "" when they're the same
+char *relative_prefix(const char *from, const char *to)
+{
+    // end of the last path component both share
+    size_t common = 0;
+    for (size_t i = 0;; i++)
+    {
+        if ((from[i] == '/' || from[i] == '\0') && (to[i] == '/' || to[i] == '\0'))
+            common = i;
+        if (from[i] != to[i] || from[i] == '\0')
+            break;
+    }
+    int levels = 0;
+    for (const char *c = from + common; *c; c++)
+        if (*c != '/' && c[-1] == '/')
+            levels++;
+    const char *rest = to + common;
+    while (*rest == '/')
+        rest++;
+    char *prefix = malloc(levels * 3 + strlen(rest) + 2);
+    char *end = prefix;
+    for (int i = 0; i < levels; i++)
+        end = stpcpy(end, "../");
+    end = stpcpy(end, rest);
+    if (*rest)
+        strcpy(end, "/");
+    return prefix;
+}
+
+// --check: hashes every file of a checksum file again, paths are relative to the checksum file's directory
+bool check_checksums(const char *path)
+{
+    FILE *list = fopen(path, "r");
+    if (list == NULL)
+    {
+        perror("Failed to open checksum file");
+        return false;
+    }
+    char *directory = strdup(path);
+    char *slash = strrchr(directory, '/');
+    if (slash)
+        *(slash == directory ? slash + 1 : slash) = '\0';
+    int dir_fd = open(slash ? directory : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(directory);
+    if (dir_fd == -1)
+    {
+        perror("Failed to open checksum file directory");
+        fclose(list);
+        return false;
+    }
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+    long checked = 0, mismatched = 0, unreadable = 0;
+    while ((length = getline(&line, &line_capacity, list)) != -1)
+    {
+        if (length > 0 && line[length - 1] == '\n')
+            line[--length] = '\0';
+        unsigned long long expected, actual;
+        int name_offset = 0;
+        if (sscanf(line, "%16llx  %n", &expected, &name_offset) != 1 || name_offset == 0 || line[name_offset] == '\0')
+        {
+            if (length > 0)
+                printf("Skipping malformed line: %s\n", line);
+            continue;
+        }
+        const char *name = line + name_offset;
+        checked++;
+        int fd = openat(dir_fd, name, O_RDONLY);
+        struct stat state;
+        if (fd == -1 || fstat(fd, &state) != 0 || !hash_file(fd, state.st_size, &actual))
+        {
+            printf("MISSING %s\n", name);
+            unreadable++;
+        }
+        else if (actual != expected)
+        {
+            printf("FAILED  %s (expected %016llx, got %016llx)\n", name, expected, actual);
+            mismatched++;
+        }
+        if (fd != -1)
+            close(fd);
+    }
+    free(line);
+    fclose(list);
+    close(dir_fd);
+    printf("Checked %ld files: %ld mismatched, %ld missing or unreadable.\n", checked, mismatched, unreadable);
+    return mismatched == 0 && unreadable == 0;
+}
+
+bool hash_file_at(int dir_fd, const char *name, off_t size, unsigned long long *hash)
+{
+    int fd = openat(dir_fd, name, O_RDONLY);
+    if (fd == -1)
+    {
+        perror("Failed to open file for hashing");
+        return false;
+    }
+    bool hashed = hash_file(fd, size, hash);
+    close(fd);
+    return hashed;
+}
+
+// --verify: reads the destination back and compares it with the hash taken while copying
+bool verify_copy(int destination_dir_fd, const char *destination_name, const char *destination_path, off_t size, unsigned long long source_hash)
+{
+    unsigned long long destination_hash = 0;
+    if (hash_file_at(destination_dir_fd, destination_name, size, &destination_hash) && destination_hash == source_hash)
+        return true;
+    printf("%sVerification failed for %s (source %016llx, destination %016llx).\n", clear_line, destination_path, source_hash, destination_hash);
+    __atomic_add_fetch(&verify_failures, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+// Replaces the just created [destination_name] with a link to the first copy of the source's inode. Returns false
+// for the first name of an inode, which is remembered and sets [first_name], or when linking fails: the file is
+// then copied normally
+bool link_to_first_copy(const struct stat *source_state, struct dir_handle *destination_dir, const char *destination_name, const char *destination_path, bool *first_name)
+{
+    struct dir_handle *first_dir;
+    char *first_name_copy;
+    *first_name = !find_or_add_link(source_state->st_dev, source_state->st_ino, destination_dir, destination_name, &first_dir, &first_name_copy);
+    if (*first_name || first_dir == NULL)
+        return false;
+    bool linked = replace_with_link(first_dir, first_name_copy, destination_dir->fd, destination_name);
+    if (linked)
+    {
+        printf("%sLinked %s => %s/%s (hard link)\n", clear_line, destination_path, first_dir->path, first_name_copy);
+        if (stats_mode != STATS_NONE)
+            __atomic_add_fetch(&stats.linked_files, 1, __ATOMIC_RELAXED);
+        // the plan doesn't count the bytes of later names
+        if (progress_mode != PROGRESS_NONE)
+            __atomic_add_fetch(&progress.files, 1, __ATOMIC_RELAXED);
+    }
+    release_dir_handle(first_dir);
+    free(first_name_copy);
+    return linked;
+}
+
+// Links [target_name] in [target_dir] under a temporary name and renames it over the file just created, a failure
+// leaves that file to be copied. Both names are resolved relative to their directory fds
+bool replace_with_link(struct dir_handle *target_dir, const char *target_name, int dir_fd, const char *name)
+{
+    if (!use_dir_handle(target_dir))
+    {
+        perror("Failed to reopen the directory of the first copy, copying the data instead");
+        return false;
+    }
+    char temporary_name[TEMPORARY_NAME_SIZE];
+    make_temporary_name(temporary_name);
+    bool linked = linkat(target_dir->fd, target_name, dir_fd, temporary_name, 0) == 0 && renameat(dir_fd, temporary_name, dir_fd, name) == 0;
+    int error = errno;
+    if (!linked)
+        perror("Failed to create hard link, copying the data instead");
+    // also after a rename, which does nothing when both names are already links to the same file (an earlier run)
+    unlinkat(dir_fd, temporary_name, 0);
+    unuse_dir_handle(target_dir);
+    // the caller tells a destination without hard links from other failures
+    errno = error;
+    return linked;
+}
+
+// Returns true when the inode already has a first name, which is set in [first_dir] (retained, NULL when its copy
+// failed) and [first_name]. Otherwise adds [name] in [dir] as the first name and returns false. A first name is only
+// given out once its copy is complete (with --durable=file, published under its name), so a later name never links
+// to partial data
+bool find_or_add_link(dev_t device, ino_t inode, struct dir_handle *dir, const char *name, struct dir_handle **first_dir, char **first_name)
+{
+    pthread_mutex_lock(&link_table.lock);
+    struct link_entry *entry;
+    // the table may grow while waiting, so the entry is looked up again
+    while ((entry = find_link_entry(device, inode))->used && entry->pending)
+        pthread_cond_wait(&link_table.finished, &link_table.lock);
+    bool found = entry->used;
+    if (found)
+    {
+        *first_dir = entry->dir ? retain_dir_handle(entry->dir) : NULL;
+        *first_name = entry->dir ? strdup(entry->name) : NULL;
+    }
+    else
+    {
+        entry->used = true;
+        entry->device = device;
+        entry->inode = inode;
+        entry->dir = retain_dir_handle(dir);
+        entry->name = strdup(name);
+        entry->pending = true;
+        link_table.count++;
+    }
+    pthread_mutex_unlock(&link_table.lock);
+    return found;
+}
+
+// The inode's entry, or the free slot where it goes, with the table lock held
+struct link_entry *find_link_entry(dev_t device, ino_t inode)
+{
+    if ((link_table.count + 1) * 10 > link_table.capacity * 7)
+        grow_link_table();
+    size_t mask = link_table.capacity - 1;
+    size_t index = link_index(device, inode);
+    while (link_table.entries[index].used && (link_table.entries[index].device != device || link_table.entries[index].inode != inode))
+        index = (index + 1) & mask;
+    return &link_table.entries[index];
+}
+
+// Called by the first name of an inode once it's done. When it wasn't [copied], later names are copied instead of
+// linked to it
+void finish_link(dev_t device, ino_t inode, bool copied)
+{
+    pthread_mutex_lock(&link_table.lock);
+    struct link_entry *entry = find_link_entry(device, inode);
+    if (!copied && entry->dir)
+    {
+        release_dir_handle(entry->dir);
+        free(entry->name);
+        entry->dir = NULL;
+    }
+    if (entry->pending)
+    {
+        entry->pending = false;
+        pthread_cond_broadcast(&link_table.finished);
+    }
+    pthread_mutex_unlock(&link_table.lock);
+}
+
+// Home slot of an inode, the multiply mixes sequential inode numbers into the high bits
+size_t link_index(dev_t device, ino_t inode)
+{
+    return (((unsigned long long)inode ^ ((unsigned long long)device << 40)) * HASH_PRIME_1 >> 32) & (link_table.capacity - 1);
+}
+
+void grow_link_table()
+{
+    struct link_entry *old_entries = link_table.entries;
+    size_t old_capacity = link_table.capacity;
+    link_table.capacity = old_capacity ? old_capacity * 2 : 1024;
+    link_table.entries = calloc(link_table.capacity, sizeof(struct link_entry));
+    size_t mask = link_table.capacity - 1;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (!old_entries[i].used)
+            continue;
+        size_t index = link_index(old_entries[i].device, old_entries[i].inode);
+        while (link_table.entries[index].used)
+            index = (index + 1) & mask;
+        link_table.entries[index] = old_entries[i];
     }
+    free(old_entries);
+}
 
-    DIR *dir = opendir(source_dir);
-    if (!dir)
+// Releases the directories of the first names, which may set their --preserve times
+void free_link_table()
+{
+    for (size_t i = 0; i < link_table.capacity; i++)
     {
-        perror("Failed to open source directory");
-        return;
+        if (link_table.entries[i].used && link_table.entries[i].dir)
+        {
+            release_dir_handle(link_table.entries[i].dir);
+            free(link_table.entries[i].name);
+        }
     }
-    bool recursive_overwrite_check = enable_overwrite_check;
-
-    // full path = destination_dir/dir_name\0
-    char *full_destination_path = malloc(strlen(destination_dir) + strlen(dir_name) + 2);
-    sprintf(full_destination_path, "%s/%s", destination_dir, dir_name);
+    free(link_table.entries);
+    link_table.entries = NULL;
+    link_table.capacity = link_table.count = 0;
+}
 
-    enum source_type dest_type = get_source_type(full_destination_path);
+// --dedup: looks for a file with the same content written earlier in this run and shares its data instead of
+// copying. Candidates need the same size and sampled-block hash, the full hashes are only computed for those, and
+// the bytes only compared with a candidate whose full hash matches.
+// Returns how the data was shared, DEDUP_NONE when the file has to be copied
+enum dedup_mode deduplicate(int source_file, const struct stat *source_state, int destination_dir_fd, const char *destination_name, int destination_file, const char *destination_path, struct fingerprint *fingerprint)
+{
+    enum dedup_mode mode = __atomic_load_n(&dedup_mode, __ATOMIC_RELAXED);
+    off_t size = source_state->st_size;
+    fingerprint->sampled = false;
+    if (!sample_hash(source_file, size, fingerprint))
+        return DEDUP_NONE;
 
-    if (dest_type == NOT_EXIST)
-        recursive_overwrite_check = false;
+    size_t candidates[DEDUP_MAX_CANDIDATES];
+    int candidate_count = 0;
+    pthread_mutex_lock(&dedup_table.lock);
+    if (dedup_table.slot_capacity > 0)
+    {
+        size_t mask = dedup_table.slot_capacity - 1;
+        for (size_t slot = dedup_slot(size, fingerprint->sample_hash); dedup_table.slots[slot] && candidate_count < DEDUP_MAX_CANDIDATES; slot = (slot + 1) & mask)
+        {
+            struct dedup_entry *entry = &dedup_table.entries[dedup_table.slots[slot] - 1];
+            if (entry->size == size && entry->sample_hash == fingerprint->sample_hash)
+                candidates[candidate_count++] = dedup_table.slots[slot] - 1;
+        }
+    }
+    pthread_mutex_unlock(&dedup_table.lock);
+    if (candidate_count == 0)
+        return DEDUP_NONE;
 
-    char new_name[256];
-    while (dest_type == F)
+    if (!fingerprint->has_full_hash)
     {
-        printf("Destination %s is a file.\nCannot overwrite a file with a directory.\nEnter new name for %s: ", full_destination_path, source_dir);
-        read_string(new_name, sizeof(new_name));
-        NL;
-        full_destination_path = realloc(full_destination_path, strlen(destination_dir) + strlen(new_name) + 2);
-        sprintf(full_destination_path, "%s/%s", destination_dir, new_name);
-        dest_type = get_source_type(full_destination_path);
-        if (dest_type == NOT_EXIST)
-            recursive_overwrite_check = false;
+        bool hashed = hash_file(source_file, size, &fingerprint->full_hash);
+        // the copy starts from the beginning again
+        if (lseek(source_file, 0, SEEK_SET) == -1 || !hashed)
+            return DEDUP_NONE;
+        fingerprint->has_full_hash = true;
     }
-    while (dest_type == D && enable_overwrite_check)
+
+    for (int i = 0; i < candidate_count; i++)
     {
-        printf("Destination %s already exists.\nDo you want to overwrite it by %s ? (y/n): ", full_destination_path, source_dir);
-        char want_overwrite = read_char();
-        NL;
+        // entries never move or go away, only the array holding them is reallocated
+        pthread_mutex_lock(&dedup_table.lock);
+        struct dedup_entry *entry = &dedup_table.entries[candidates[i]];
+        struct dir_handle *original_dir = retain_dir_handle(entry->dir);
+        char *original_name = strdup(entry->name);
+        bool has_full_hash = entry->has_full_hash;
+        unsigned long long full_hash = entry->full_hash;
+        pthread_mutex_unlock(&dedup_table.lock);
+        if (!use_dir_handle(original_dir))
+        {
+            release_dir_handle(original_dir);
+            free(original_name);
+            continue;
+        }
 
-        if (want_overwrite != 'y' && want_overwrite != 'n')
+        // hashed once, from the destination copy
+        if (!has_full_hash && hash_file_at(original_dir->fd, original_name, size, &full_hash))
         {
-            printf("Invalid response. Please enter 'y' or 'n'.\n\n");
+            has_full_hash = true;
+            pthread_mutex_lock(&dedup_table.lock);
+            dedup_table.entries[candidates[i]].full_hash = full_hash;
+            dedup_table.entries[candidates[i]].has_full_hash = true;
+            pthread_mutex_unlock(&dedup_table.lock);
+        }
+        // XXH64 isn't collision resistant and collisions can be crafted, equal hashes only pick the file whose bytes
+        // are compared
+        int original = has_full_hash && full_hash == fingerprint->full_hash ? openat(original_dir->fd, original_name, O_RDONLY) : -1;
+        if (original == -1 || !same_data(source_file, original, size))
+        {
+            if (original != -1)
+                close(original);
+            unuse_dir_handle(original_dir);
+            release_dir_handle(original_dir);
+            free(original_name);
             continue;
         }
-        if (want_overwrite == 'n')
+
+        bool shared = false;
+        // nothing can be shared on a destination that can't link or clone, hashing for it stops
+        if (mode == DEDUP_HARDLINK)
         {
-            printf("Enter new name for %s: ", source_dir);
-            read_string(new_name, sizeof(new_name));
-            NL;
-            full_destination_path = realloc(full_destination_path, strlen(destination_dir) + strlen(new_name) + 2);
-            sprintf(full_destination_path, "%s/%s", destination_dir, new_name);
+            shared = replace_with_link(original_dir, original_name, destination_dir_fd, destination_name);
+            if (!shared && (is_unsupported_error(errno) || errno == EPERM))
+                stop_dedup("The destination can't hard-link files, --dedup is off.");
         }
         else
-            break;
+        {
+            // a clone only grows the destination, an older and longer one is cut to the size
+            shared = ioctl(destination_file, FICLONE, original) == 0 && ftruncate(destination_file, size) == 0;
+            if (!shared && (is_unsupported_error(errno) || errno == ENOTTY))
+                stop_dedup("The destination can't clone files, --dedup is off (--dedup=hardlink links them instead).");
+        }
+        close(original);
+        if (shared)
+        {
+            printf("%sDeduplicated %s => %s/%s (%s)\n", clear_line, destination_path, original_dir->path, original_name, mode == DEDUP_HARDLINK ? "hard link" : "reflink");
+            __atomic_add_fetch(&dedup_savings.files, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&dedup_savings.bytes, size, __ATOMIC_RELAXED);
+            if (progress_mode != PROGRESS_NONE)
+            {
+                add_progress(size);
+                __atomic_add_fetch(&progress.files, 1, __ATOMIC_RELAXED);
+            }
+        }
+        unuse_dir_handle(original_dir);
+        release_dir_handle(original_dir);
+        free(original_name);
+        return shared ? mode : DEDUP_NONE;
+    }
+    return DEDUP_NONE;
+}
 
-        dest_type = get_source_type(full_destination_path);
-        if (dest_type == NOT_EXIST)
-            recursive_overwrite_check = false;
+// Turns --dedup off for the rest of the run, [reason] is printed by the first thread to see it and again at exit
+void stop_dedup(const char *reason)
+{
+    if (__atomic_exchange_n(&dedup_mode, DEDUP_NONE, __ATOMIC_RELAXED) == DEDUP_NONE)
+        return;
+    __atomic_store_n(&dedup_off_reason, reason, __ATOMIC_RELAXED);
+    printf("%s%s\n", clear_line, reason);
+}
+
+// Compares the first [size] bytes of two files, read at explicit offsets so the file offsets stay where they are
+bool same_data(int file, int other_file, off_t size)
+{
+    struct copy_buffer *buffer = acquire_buffer(size);
+    struct copy_buffer *other_buffer = buffer ? acquire_buffer(size) : NULL;
+    bool same = other_buffer != NULL;
+    size_t chunk = same ? (buffer->size < other_buffer->size ? buffer->size : other_buffer->size) : 0;
+    for (off_t offset = 0; same && offset < size; offset += chunk)
+    {
+        size_t length = next_chunk(size, offset, chunk);
+        same = pread(file, buffer->data, length, offset) == (ssize_t)length &&
+               pread(other_file, other_buffer->data, length, offset) == (ssize_t)length &&
+               !memcmp(buffer->data, other_buffer->data, length);
     }
+    if (buffer)
+        release_buffer(buffer);
+    if (other_buffer)
+        release_buffer(other_buffer);
+    return same;
+}
 
-    // Create the destination directory
-    if (!make_dir(full_destination_path))
+// Hash of three DEDUP_SAMPLE_SIZE blocks (start, middle, end). Small files are hashed whole, which is their full
+// hash too
+bool sample_hash(int source_file, off_t size, struct fingerprint *fingerprint)
+{
+    char block[3 * DEDUP_SAMPLE_SIZE];
+    struct hash_state state;
+    hash_init(&state);
+    fingerprint->has_full_hash = size <= (off_t)sizeof(block);
+    if (fingerprint->has_full_hash)
     {
-        closedir(dir);
-        free(full_destination_path);
-        return;
+        if (pread(source_file, block, size, 0) != size)
+            return false;
+        hash_update(&state, block, size);
     }
-    struct dirent *entry;
+    else
+    {
+        off_t offsets[3] = {0, size / 2, size - DEDUP_SAMPLE_SIZE};
+        for (int i = 0; i < 3; i++)
+        {
+            if (pread(source_file, block, DEDUP_SAMPLE_SIZE, offsets[i]) != DEDUP_SAMPLE_SIZE)
+                return false;
+            hash_update(&state, block, DEDUP_SAMPLE_SIZE);
+        }
+    }
+    fingerprint->sample_hash = hash_final(&state);
+    fingerprint->full_hash = fingerprint->sample_hash;
+    fingerprint->sampled = true;
+    return true;
+}
 
-    while ((entry = readdir(dir)) != NULL)
+// Makes a file written by this run available to later duplicates
+void add_dedup_entry(off_t size, const struct fingerprint *fingerprint, struct dir_handle *dir, const char *name)
+{
+    pthread_mutex_lock(&dedup_table.lock);
+    if (dedup_table.count == dedup_table.capacity)
     {
-        // Skip the "." and ".." entries
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
+        dedup_table.capacity = dedup_table.capacity ? dedup_table.capacity * 2 : 1024;
+        dedup_table.entries = realloc(dedup_table.entries, sizeof(struct dedup_entry) * dedup_table.capacity);
+    }
+    if ((dedup_table.count + 1) * 10 > dedup_table.slot_capacity * 7)
+    {
+        // rebuild the index at twice the size
+        free(dedup_table.slots);
+        dedup_table.slot_capacity = dedup_table.slot_capacity ? dedup_table.slot_capacity * 2 : 2048;
+        dedup_table.slots = calloc(dedup_table.slot_capacity, sizeof(size_t));
+        for (size_t i = 0; i < dedup_table.count; i++)
+            insert_dedup_slot(i);
+    }
+    struct dedup_entry *entry = &dedup_table.entries[dedup_table.count];
+    entry->size = size;
+    entry->sample_hash = fingerprint->sample_hash;
+    entry->full_hash = fingerprint->full_hash;
+    entry->has_full_hash = fingerprint->has_full_hash;
+    entry->dir = retain_dir_handle(dir);
+    entry->name = strdup(name);
+    insert_dedup_slot(dedup_table.count++);
+    pthread_mutex_unlock(&dedup_table.lock);
+}
 
-        char *source_path = malloc(strlen(source_dir) + strlen(entry->d_name) + 2);
-        sprintf(source_path, "%s/%s", source_dir, entry->d_name);
+void insert_dedup_slot(size_t index)
+{
+    size_t mask = dedup_table.slot_capacity - 1;
+    size_t slot = dedup_slot(dedup_table.entries[index].size, dedup_table.entries[index].sample_hash);
+    while (dedup_table.slots[slot])
+        slot = (slot + 1) & mask;
+    dedup_table.slots[slot] = index + 1;
+}
 
-        enum source_type src_type = get_source_type(source_path);
-        if (src_type == F)
-            copy_file(source_path, full_destination_path, entry->d_name, recursive_overwrite_check);
-        else if (src_type == D)
-            copy_directory(source_path, full_destination_path, entry->d_name, recursive_overwrite_check);
-        else
-            printf("Can't find Source %s . Skipping.\n\n", source_path);
+size_t dedup_slot(off_t size, unsigned long long sample_hash)
+{
+    return (((unsigned long long)size * HASH_PRIME_1 ^ sample_hash) >> 16) & (dedup_table.slot_capacity - 1);
+}
 
-        free(source_path);
+// Releases the directories of the copies, the count stays for the savings message
+void free_dedup_table()
+{
+    for (size_t i = 0; i < dedup_table.count; i++)
+    {
+        release_dir_handle(dedup_table.entries[i].dir);
+        free(dedup_table.entries[i].name);
     }
-    free(full_destination_path);
+    free(dedup_table.entries);
+    free(dedup_table.slots);
+}
 
-    closedir(dir);
+bool parse_durable_mode(const char *name)
+{
+    if (!strcmp(name, "none"))
+        durable_mode = DURABLE_NONE;
+    else if (!strcmp(name, "batch"))
+        durable_mode = DURABLE_BATCH;
+    else if (!strcmp(name, "file"))
+        durable_mode = DURABLE_FILE;
+    else
+        return false;
+    return true;
 }
 
-void remove_last_slash(char **path)
+// Opens the destination for writing. With --durable=file it's an unnamed O_TMPFILE, or a temporary name where
+// there's no O_TMPFILE, that publish_file() names once it's complete. [temporary_name] is left empty otherwise
+int open_destination_file(int dir_fd, const char *name, mode_t mode, bool truncate, char *temporary_name)
 {
-    int len = strlen(*path);
-    if (len > 1 && (*path)[len - 1] == '/')
+    temporary_name[0] = '\0';
+    if (durable_mode != DURABLE_FILE)
+        return openat(dir_fd, name, O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0), mode);
+    if (__atomic_load_n(&anonymous_files, __ATOMIC_RELAXED))
     {
-        (*path)[len - 1] = '\0';
+        // readable, publish_file() copies it to a temporary name when it can't be linked
+        int fd = openat(dir_fd, ".", O_TMPFILE | O_RDWR, mode);
+        // old kernels report EISDIR
+        if (fd != -1 || !(is_unsupported_error(errno) || errno == EISDIR))
+            return fd;
+        __atomic_store_n(&anonymous_files, false, __ATOMIC_RELAXED);
     }
+    make_temporary_name(temporary_name);
+    return openat(dir_fd, temporary_name, O_WRONLY | O_CREAT | O_EXCL, mode);
 }
 
-void decode_source_path(const char *path, char **name, char **true_path)
+// fsyncs a --durable=file destination and renames it over [name], so the name only ever shows a complete file
+bool publish_file(int fd, int dir_fd, const char *name, char *temporary_name)
 {
-    char *r_path = realpath(path, NULL);
-    int len = strlen(path);
-    char *colon = strrchr(path, ':');
-    char *last_slash = strrchr(path, '/');
+    unsigned long long timer = start_timer();
+    int result = fsync(fd);
+    stop_timer(PHASE_SYNC, timer);
+    if (result == -1)
+    {
+        perror("Failed to sync destination file");
+        return false;
+    }
+    // an O_TMPFILE gets a temporary name first, linkat() can't replace an existing destination. AT_EMPTY_PATH needs
+    // CAP_DAC_READ_SEARCH, /proc/self/fd needs a mounted /proc
+    if (temporary_name[0] == '\0')
+    {
+        char fd_path[32];
+        snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+        make_temporary_name(temporary_name);
+        if (linkat(fd, "", dir_fd, temporary_name, AT_EMPTY_PATH) == -1 &&
+            linkat(AT_FDCWD, fd_path, dir_fd, temporary_name, AT_SYMLINK_FOLLOW) == -1 &&
+            !copy_to_temporary_name(fd, dir_fd, name, temporary_name))
+        {
+            temporary_name[0] = '\0';
+            return false;
+        }
+    }
+    if (renameat(dir_fd, temporary_name, dir_fd, name) == -1)
+    {
+        perror("Failed to rename destination file");
+        return false;
+    }
+    temporary_name[0] = '\0';
+    return true;
+}
 
-    if (r_path)
+// Copies an O_TMPFILE that can't be linked to [temporary_name], with the --preserve attributes it already has, and
+// writes the later files under temporary names
+bool copy_to_temporary_name(int fd, int dir_fd, const char *name, const char *temporary_name)
+{
+    __atomic_store_n(&anonymous_files, false, __ATOMIC_RELAXED);
+    struct stat state;
+    int named = fstat(fd, &state) == -1 ? -1 : openat(dir_fd, temporary_name, O_WRONLY | O_CREAT | O_EXCL, state.st_mode & 07777);
+    if (named == -1)
     {
-        *name = strdup(strrchr(r_path, '/') + 1);
-        *true_path = strdup(r_path);
+        perror("Failed to link destination file");
+        return false;
     }
-    else if (colon && colon > last_slash && path[len - 1] != ':')
+    bool copied = lseek(fd, 0, SEEK_SET) == 0 && copy_with_read_write(fd, named, -1, 0) == COPY_DONE;
+    if (copied)
     {
-        *name = strdup(colon + 1);
-        int true_path_len = colon - path;
-        char *tmp = malloc(true_path_len + 1);
-        strncpy(tmp, path, true_path_len);
-        (tmp)[true_path_len] = '\0';
-        r_path = realpath(tmp, NULL);
-        if (r_path)
-            *true_path = strdup(r_path);
-        else
-            *true_path = strdup(tmp);
-        free(tmp);
+        preserve_metadata(fd, &state, named, name, NULL);
+        unsigned long long timer = start_timer();
+        copied = fsync(named) == 0;
+        stop_timer(PHASE_SYNC, timer);
     }
-    else
+    if (!copied)
     {
-        *true_path = strdup(path);
-        if (last_slash)
-            *name = strdup(last_slash + 1);
-        else
-            *name = strdup(path);
+        perror("Failed to copy destination file to a temporary name");
+        unlinkat(dir_fd, temporary_name, 0);
     }
-    free(r_path);
+    close(named);
+    return copied;
 }
 
-bool create_directories_recursively(const char *path)
+// Removes the temporary name of a --durable=file destination that won't be published
+void discard_file(int dir_fd, char *temporary_name)
 {
-    enum source_type type = get_source_type(path);
+    if (temporary_name[0] != '\0')
+        unlinkat(dir_fd, temporary_name, 0);
+    temporary_name[0] = '\0';
+}
 
-    if (type == D)
-        return true;
+// Hidden name for files that are renamed over their destination once complete
+void make_temporary_name(char *buffer)
+{
+    static unsigned long counter = 0;
+    snprintf(buffer, TEMPORARY_NAME_SIZE, ".safe_cp.%d.%lu", getpid(), __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED));
+}
 
-    if (type == F)
+// Remembers the filesystem of a destination directory for the --durable sync at the end
+void track_filesystem(int dir_fd)
+{
+    struct stat state;
+    if (fstat(dir_fd, &state) == -1)
+        return;
+    pthread_mutex_lock(&synced_filesystems.lock);
+    int i = 0;
+    while (i < synced_filesystems.count && synced_filesystems.devices[i] != state.st_dev)
+        i++;
+    if (i == synced_filesystems.count)
     {
-        printf("Path %s is a file, choose a different path.\n\n", path);
-        return false;
+        int fd = i < DURABLE_MAX_FILESYSTEMS ? fcntl(dir_fd, F_DUPFD_CLOEXEC, 0) : -1;
+        if (fd == -1)
+            synced_filesystems.everything = true;
+        else
+        {
+            synced_filesystems.devices[i] = state.st_dev;
+            synced_filesystems.fds[i] = fd;
+            synced_filesystems.count++;
+        }
     }
+    pthread_mutex_unlock(&synced_filesystems.lock);
+}
 
-    printf("Destination directory %s does not exist.\nWant to create it (y/n)? : ", path);
-    char response = read_char();
-    NL;
-    if (response != 'y')
+// One syncfs() per destination filesystem writes back the data, inodes and directory entries of everything copied,
+// the created directories included. Returns false when a sync failed
+bool sync_filesystems()
+{
+    bool synced = true;
+    unsigned long long timer = start_timer();
+    if (synced_filesystems.everything)
+        sync();
+    for (int i = 0; i < synced_filesystems.count; i++)
     {
-        printf("Directory creation aborted. Exiting.\n\n");
-        return false;
+        if (syncfs(synced_filesystems.fds[i]) == -1)
+        {
+            perror("Failed to sync destination filesystem");
+            synced = false;
+        }
+        close(synced_filesystems.fds[i]);
     }
+    stop_timer(PHASE_SYNC, timer);
+    if (synced && synced_filesystems.everything)
+        printf("%sNot every destination filesystem could be tracked, synced all filesystems to disk.\n", clear_line);
+    else if (synced)
+        printf("%sSynced %d destination filesystem%s to disk.\n", clear_line, synced_filesystems.count, synced_filesystems.count == 1 ? "" : "s");
+    synced_filesystems.count = 0;
+    return synced;
+}
 
-    int len = strlen(path), i = 0;
-    char *tmp_path = malloc(len + 1);
-    tmp_path[len] = '\0';
+bool parse_preserve_attributes(const char *list)
+{
+    const char *names[] = {"mode", "timestamps", "ownership", "xattr", "all"};
+    int attributes[] = {PRESERVE_MODE, PRESERVE_TIMESTAMPS, PRESERVE_OWNERSHIP, PRESERVE_XATTR, PRESERVE_ALL};
+    preserve_attributes = 0;
+    while (*list)
+    {
+        size_t length = strcspn(list, ",");
+        int i = 0;
+        while (i < 5 && (strlen(names[i]) != length || strncmp(names[i], list, length)))
+            i++;
+        if (i == 5)
+            return false;
+        preserve_attributes |= attributes[i];
+        list += length + (list[length] == ',');
+    }
+    return true;
+}
 
-    if (path[0] == '/')
+// Copies the --preserve attributes of a source to its open destination. A directory's mode and times are only
+// recorded in [destination_dir], restore_dir_metadata() sets them once its entries are done
+void preserve_metadata(int source_fd, const struct stat *source_state, int destination_fd, const char *destination_path, struct dir_handle *destination_dir)
+{
+    int attributes = __atomic_load_n(&preserve_attributes, __ATOMIC_RELAXED);
+    if (attributes & PRESERVE_XATTR)
+        copy_xattrs(source_fd, destination_fd, destination_path);
+    // before the mode, fchown() clears the set-user-ID and set-group-ID bits
+    if ((attributes & PRESERVE_OWNERSHIP) && fchown(destination_fd, source_state->st_uid, source_state->st_gid) == -1)
     {
-        i = 1;
-        tmp_path[0] = '/';
+        if (errno == EPERM)
+            drop_preserved(PRESERVE_OWNERSHIP, "Not allowed to change the owner of the copies, --preserve=ownership is off.\n");
+        else
+            perror("Failed to preserve ownership");
+    }
+    if (destination_dir)
+    {
+        destination_dir->mode = source_state->st_mode & 07777;
+        destination_dir->times[0] = source_state->st_atim;
+        destination_dir->times[1] = source_state->st_mtim;
+        destination_dir->restore_metadata = attributes & (PRESERVE_MODE | PRESERVE_TIMESTAMPS);
+        return;
     }
+    if ((attributes & PRESERVE_MODE) && fchmod(destination_fd, source_state->st_mode & 07777) == -1)
+        perror("Failed to preserve mode");
+    struct timespec times[2] = {source_state->st_atim, source_state->st_mtim};
+    if ((attributes & PRESERVE_TIMESTAMPS) && futimens(destination_fd, times) == -1)
+        perror("Failed to preserve timestamps");
+}
 
-    for (; i < len; i++)
+// Files without extended attributes cost one flistxattr()
+void copy_xattrs(int source_fd, int destination_fd, const char *destination_path)
+{
+    ssize_t list_size = flistxattr(source_fd, NULL, 0);
+    if (list_size <= 0)
+        return;
+    char *names = malloc(list_size);
+    list_size = flistxattr(source_fd, names, list_size);
+    char *value = NULL;
+    size_t value_capacity = 0;
+    for (char *name = names; list_size > 0 && name < names + list_size; name += strlen(name) + 1)
     {
-        if (path[i] == '/')
+        ssize_t size = fgetxattr(source_fd, name, NULL, 0);
+        if (size > 0 && (size_t)size > value_capacity)
         {
-            tmp_path[i] = '\0';
-            if (!make_dir(tmp_path))
-            {
-                free(tmp_path);
-                return false;
-            }
+            value_capacity = size;
+            value = realloc(value, value_capacity);
         }
-        tmp_path[i] = path[i];
+        if (size >= 0)
+            size = fgetxattr(source_fd, name, value, size);
+        if (size < 0 || fsetxattr(destination_fd, name, value, size, 0) == 0)
+            continue;
+        if (errno == ENOTSUP)
+        {
+            drop_preserved(PRESERVE_XATTR, "The destination doesn't support extended attributes, --preserve=xattr is off.\n");
+            break;
+        }
+        // trusted.* and security.* names may need privileges the others don't
+        printf("%sFailed to preserve extended attribute %s of %s: %s\n", clear_line, name, destination_path, strerror(errno));
+    }
+    free(value);
+    free(names);
+}
 
-        if (i == len - 1)
+// Sets the mode and times recorded by preserve_metadata() on a directory whose last reference is being released,
+// reopening it through its parent when the budget closed it
+void restore_dir_metadata(struct dir_handle *handle)
+{
+    if (!use_dir_handle(handle))
+    {
+        perror("Failed to reopen destination directory");
+        return;
+    }
+    int attributes = __atomic_load_n(&preserve_attributes, __ATOMIC_RELAXED);
+    if ((attributes & PRESERVE_MODE) && fchmod(handle->fd, handle->mode) == -1)
+        perror("Failed to preserve mode");
+    if ((attributes & PRESERVE_TIMESTAMPS) && futimens(handle->fd, handle->times) == -1)
+        perror("Failed to preserve timestamps");
+    unuse_dir_handle(handle);
+}
+
+// Stops preserving an attribute the destination can't take, [message] is printed by the first thread to see it
+void drop_preserved(int attribute, const char *message)
+{
+    if (__atomic_fetch_and(&preserve_attributes, ~attribute, __ATOMIC_RELAXED) & attribute)
+        printf("%s%s", clear_line, message);
+}
+
+bool parse_symlink_mode(const char *name)
+{
+    if (!strcmp(name, "copy"))
+        symlink_mode = SYMLINKS_COPY;
+    else if (!strcmp(name, "follow"))
+        symlink_mode = SYMLINKS_FOLLOW;
+    else if (!strcmp(name, "command-line"))
+        symlink_mode = SYMLINKS_COMMAND_LINE;
+    else
+        return false;
+    return true;
+}
+
+// Whether a symbolic link is copied as what it points to, [command_line] for the sources given with -s
+bool follow_links(bool command_line)
+{
+    return symlink_mode == SYMLINKS_FOLLOW || (command_line && symlink_mode == SYMLINKS_COMMAND_LINE);
+}
+
+// --symlinks=follow: a directory reached through a link to one of its own parents would be copied without end.
+// Records the directory's (device, inode) for the directories below it, and returns the parent it repeats
+struct dir_handle *find_directory_cycle(struct dir_handle *source)
+{
+    struct stat state;
+    if (fstat(source->fd, &state) == -1)
+        return NULL;
+    source->device = state.st_dev;
+    source->inode = state.st_ino;
+    for (struct dir_handle *parent = source->parent; parent != NULL; parent = parent->parent)
+    {
+        if (parent->device == state.st_dev && parent->inode == state.st_ino)
+            return parent;
+    }
+    return NULL;
+}
+
+bool parse_engine(const char *name)
+{
+    if (!strcmp(name, "auto"))
+    {
+        first_engine = ENGINE_COPY_FILE_RANGE;
+        return true;
+    }
+    // reflink and direct aren't part of the fallback chain, they have their own options
+    for (int i = ENGINE_COPY_FILE_RANGE; i < ENGINE_COUNT; i++)
+    {
+        if (!strcmp(name, engine_names[i]))
         {
-            if (!make_dir(tmp_path))
-            {
-                free(tmp_path);
-                return false;
-            }
+            first_engine = i;
+            return true;
         }
     }
-    free(tmp_path);
+    return false;
+}
+
+bool parse_reflink_mode(const char *name)
+{
+    if (!strcmp(name, "auto"))
+        reflink_mode = REFLINK_AUTO;
+    else if (!strcmp(name, "always"))
+        reflink_mode = REFLINK_ALWAYS;
+    else if (!strcmp(name, "never"))
+        reflink_mode = REFLINK_NEVER;
+    else
+        return false;
+    return true;
+}
+
+bool parse_conflict_policy(const char *name)
+{
+    if (!strcmp(name, "ask"))
+        conflict_policy = CONFLICT_ASK;
+    else if (!strcmp(name, "overwrite"))
+        conflict_policy = CONFLICT_OVERWRITE;
+    else if (!strcmp(name, "skip"))
+        conflict_policy = CONFLICT_SKIP;
+    else if (!strcmp(name, "newer"))
+        conflict_policy = CONFLICT_NEWER;
+    else if (!strcmp(name, "rename-auto"))
+        conflict_policy = CONFLICT_RENAME;
+    else if (!strcmp(name, "fail"))
+        conflict_policy = CONFLICT_FAIL;
+    else
+        return false;
     return true;
 }
 
-void read_string(char *buffer, size_t buffer_size)
+// Applies --on-conflict to an existing destination. An existing directory is merged into by overwrite, skip and
+// newer, which then apply to its files. [source_state] is only needed for files and symbolic links
+enum conflict_decision resolve_conflict(int destination_dir_fd, const char *destination_name, const char *destination_path, enum source_type source_type, enum source_type destination_type, const struct stat *source_state, char *new_name, size_t new_name_size)
+{
+    enum conflict_policy policy = __atomic_load_n(&conflict_policy, __ATOMIC_RELAXED);
+    if (policy == CONFLICT_FAIL)
+    {
+        if (!__atomic_exchange_n(&conflict_stop, true, __ATOMIC_RELAXED))
+            printf("%sDestination %s already exists, stopping (--on-conflict=fail).\n", clear_line, destination_path);
+        return DECISION_SKIP;
+    }
+    if (policy == CONFLICT_RENAME)
+    {
+        if (!reserve_unique_name(destination_dir_fd, destination_name, source_type == D, source_type == D ? 0777 : (source_state->st_mode & 07777) | S_IWUSR, new_name, new_name_size))
+        {
+            printf("%sNo free name next to %s, skipping.\n", clear_line, destination_path);
+            return DECISION_SKIP;
+        }
+        printf("%sDestination %s already exists, copying to %s.\n", clear_line, destination_path, new_name);
+        return DECISION_RENAME;
+    }
+    // files and symbolic links replace each other, directories are only merged
+    if ((source_type == D) != (destination_type == D))
+    {
+        printf("%sCannot overwrite %s %s with a %s, skipping.\n", clear_line, destination_type == D ? "directory" : "file", destination_path,
+               source_type == D ? "directory" : source_type == L ? "symbolic link" : "file");
+        return DECISION_SKIP;
+    }
+    if (destination_type == D)
+        return DECISION_WRITE;
+    if (policy == CONFLICT_NEWER)
+    {
+        struct stat destination_state;
+        if (fstatat(destination_dir_fd, destination_name, &destination_state, source_type == L ? AT_SYMLINK_NOFOLLOW : 0) == -1)
+            return DECISION_WRITE;
+        if (source_state->st_mtim.tv_sec > destination_state.st_mtim.tv_sec ||
+            (source_state->st_mtim.tv_sec == destination_state.st_mtim.tv_sec && source_state->st_mtim.tv_nsec > destination_state.st_mtim.tv_nsec))
+            return DECISION_WRITE;
+        printf("%sDestination %s isn't older than the source, skipping.\n", clear_line, destination_path);
+        return DECISION_SKIP;
+    }
+    if (policy == CONFLICT_SKIP)
+    {
+        printf("%sDestination %s already exists, skipping.\n", clear_line, destination_path);
+        return DECISION_SKIP;
+    }
+    return DECISION_WRITE;
+}
+
+// Finds the first free "name.N.ext" and creates it, so a parallel job can't take the same name. Files are created
+// writable, the copy opens them again
+bool reserve_unique_name(int dir_fd, const char *name, bool directory, mode_t mode, char *new_name, size_t new_name_size)
+{
+    // the extension stays last, dot files and directories get the number at the end
+    const char *extension = directory ? NULL : strrchr(name, '.');
+    if (extension == NULL || extension == name)
+        extension = name + strlen(name);
+    int stem_length = extension - name;
+    for (int i = 1; i < 10000; i++)
+    {
+        if (snprintf(new_name, new_name_size, "%.*s.%d%s", stem_length, name, i, extension) >= (int)new_name_size)
+            return false;
+        int result = directory ? mkdirat(dir_fd, new_name, mode) : openat(dir_fd, new_name, O_WRONLY | O_CREAT | O_EXCL, mode);
+        if (result != -1)
+        {
+            if (!directory)
+                close(result);
+            return true;
+        }
+        if (errno != EEXIST)
+        {
+            perror("Failed to create a new destination name");
+            return false;
+        }
+    }
+    return false;
+}
+
+// stdin ended while a prompt waited, nothing else can be answered
+void stop_asking()
+{
+    printf("\nNo more input, existing destinations are skipped from now on (see --on-conflict).\n");
+    __atomic_store_n(&conflict_policy, CONFLICT_SKIP, __ATOMIC_RELAXED);
+}
+
+// Counts a file that was left as it is at the destination, [unchanged] when --update found it up to date
+void skip_file(off_t size, bool unchanged)
+{
+    if (stats_mode != STATS_NONE)
+        __atomic_add_fetch(unchanged ? &stats.unchanged_files : &stats.skipped_files, 1, __ATOMIC_RELAXED);
+    if (progress_mode != PROGRESS_NONE)
+    {
+        add_progress(size);
+        __atomic_add_fetch(&progress.files, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Returns false at EOF or on a read error
+bool read_string(char *buffer, size_t buffer_size)
 {
     while (1) // Loop until we get valid input
     {
@@ -454,13 +4561,13 @@ void read_string(char *buffer, size_t buffer_size)
 
             // Check if string is not empty
             if (strlen(buffer) > 0)
-                break; // Good input, exit loop
+                return true; // Good input, exit loop
         }
         else
         {
             // Handle EOF or read error, just exit
             buffer[0] = '\0';
-            break;
+            return false;
         }
 
         // If we're still here, the string was empty
@@ -487,7 +4594,15 @@ char read_char()
 
 bool make_dir(const char *path)
 {
-    if (mkdir(path, 0777) == -1 && errno != EEXIST)
+    return make_dir_at(AT_FDCWD, path);
+}
+
+bool make_dir_at(int dir_fd, const char *name)
+{
+    unsigned long long timer = start_timer();
+    int result = mkdirat(dir_fd, name, 0777);
+    stop_timer(PHASE_MKDIR, timer);
+    if (result == -1 && errno != EEXIST)
     {
         perror("Failed to create destination directory");
         return false;
@@ -508,6 +4623,75 @@ void show_help_msg()
         "  -d <destination>      Specify the destination directory.\n"
         "                        If the destination (or any parent folder) doesn't exist,\n"
         "                        it will be created automatically — like 'mkdir -p'.\n\n"
+        "  --engine=<engine>     How file data is copied (default: auto).\n"
+        "                        auto | copy_file_range | sendfile | splice | io_uring | read_write\n"
+        "                        Kernel-side engines fall back down this list, ending at\n"
+        "                        read_write, when the filesystem doesn't support them.\n\n"
+        "  --reflink=<mode>      Clone files on copy-on-write filesystems (default: auto).\n"
+        "                        auto   : clone when possible, copy the data otherwise.\n"
+        "                        always : fail files that can't be cloned.\n"
+        "                        never  : always copy the data.\n\n"
+        "  --durable[=<mode>]    Make the copy survive a crash (default: none).\n"
+        "                        batch (--durable): syncfs() each destination filesystem once\n"
+        "                        at the end. file: also fsync every file and give it its name\n"
+        "                        only when it's complete (O_TMPFILE or a temporary name).\n\n"
+        "  --on-conflict=<policy> What to do when a destination already exists, without asking.\n"
+        "                        ask (default on a terminal) | overwrite | skip (default when\n"
+        "                        stdin isn't a terminal) | newer (overwrite older files) |\n"
+        "                        rename-auto (copy to name.1.ext, name.2.ext, ...) | fail\n"
+        "                        (stop at the first conflict, exit with an error).\n\n"
+        "  --sparse=<mode>       auto (default): copy only the data of files with holes,\n"
+        "                        keeping the holes at the destination. never: copy every byte.\n\n"
+        "  --plan                Scan every source first, print file/byte totals and check the\n"
+        "                        destination's free space and inodes, then copy. A copy that\n"
+        "                        can't fit, or whose sources can't all be scanned, stops before\n"
+        "                        writing anything.\n\n"
+        "  --plan-only           Like --plan, but stop after the check.\n\n"
+        "  --jobs <N>            Copy with N threads (default: 1). Directories are created\n"
+        "                        before their entries, the result is the same as a serial copy.\n\n"
+        "  --open-dirs=<N>       Directories kept open while their entries are copied (default:\n"
+        "                        256, or a quarter of the open file limit). Past it, idle ones\n"
+        "                        are closed and reopened when needed.\n\n"
+        "  --direct=<MB>         Copy files of at least this size with O_DIRECT, bypassing the\n"
+        "                        page cache (default: off).\n\n"
+        "  --file-threads=<N>    Copy files larger than one chunk with N threads, each taking\n"
+        "                        the next chunk of the file (default: 1).\n\n"
+        "  --chunk-size=<MB>     Chunk size of --file-threads copies (default: 64).\n\n"
+        "  --stats[=json]        Print counters and timers of each phase (stat, scan, open,\n"
+        "                        copy, mkdir, prompt, sync), bytes copied, a file latency histogram\n"
+        "                        and the slowest files to stderr when done, as text or JSON.\n\n"
+        "  --progress[=lines]    Show bytes and files done out of the totals, files/s, the\n"
+        "                        current MB/s and an ETA on stderr. The sources are scanned\n"
+        "                        first for the totals. On a terminal the line is redrawn twice\n"
+        "                        a second, otherwise (or with =lines) a line is printed every\n"
+        "                        10 seconds.\n\n"
+        "  --update[=hash]       Skip files whose destination has the same size and isn't older\n"
+        "                        than the source (=hash: has the same content). Changed ones\n"
+        "                        go through --on-conflict, which defaults to overwrite here.\n\n"
+        "  --verify              Hash each file (XXH64) while it's copied, then read the\n"
+        "                        destination back and report files that don't match. The data\n"
+        "                        goes through the read/write loop, files aren't cloned (it\n"
+        "                        can't be combined with --reflink=always).\n\n"
+        "  --checksums[=<file>]  Write the hash of every copied file to <file> (default:\n"
+        "                        <destination>/checksums.xxh64), in xxhsum format, with paths\n"
+        "                        relative to the directory of <file>.\n\n"
+        "  --check=<file>        Check the files listed in a checksum file, relative to its\n"
+        "                        directory, without copying anything.\n\n"
+        "  --dedup[=<mode>]      Share the data of files identical to one already copied in this\n"
+        "                        run (same size, sampled blocks, full XXH64 hash, then the\n"
+        "                        bytes themselves).\n"
+        "                        reflink (default): clone it. hardlink: link to it.\n\n"
+        "  --preserve[=<list>]   Copy these attributes of files and directories, separated by\n"
+        "                        commas: mode, timestamps, ownership, xattr, or all (the\n"
+        "                        default). Directory times are set once their entries are done.\n\n"
+        "  --symlinks=<mode>     copy (default): recreate symbolic links as links. follow: copy\n"
+        "                        what they point to, skipping links to a parent directory.\n"
+        "                        command-line: follow the sources given with -s only.\n\n"
+        "  --no-hard-links       Copy the data of every name of a hard-linked file, instead of\n"
+        "                        linking the later names to the first copy.\n\n"
+        "  --no-preallocate      Don't reserve the destination blocks with fallocate before\n"
+        "                        copying files larger than 64 KB.\n\n"
+        "  --buffer-memory=<MB>  Memory budget of the reusable copy buffers (default: 256).\n\n"
         "  -h, --help            Display this help message.\n\n"
         "Behavior:\n"
         "  • Copies both files and directories recursively.\n"
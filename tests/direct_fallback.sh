@@ -0,0 +1,66 @@
+#!/bin/sh
+# Checks the fallback of --direct on a filesystem that accepts O_DIRECT at open but rejects the I/O: an LD_PRELOAD
+# shim fails every write() to an O_DIRECT fd with EINVAL, the copy has to finish on the other engines with the
+# source's bytes.
+#
+# Usage: tests/direct_fallback.sh      (exits 0 when every case passes)
+#
+# Environment:
+#   TEST_DIR  where the files are made (default: a new directory from mktemp -d), removed at the end
+
+set -u
+
+REPO=$(cd "$(dirname "$0")/.." && pwd)
+TEST_DIR=${TEST_DIR:-$(mktemp -d)}
+trap 'rm -rf "$TEST_DIR"' EXIT
+mkdir -p "$TEST_DIR" || exit 1
+
+cat > "$TEST_DIR/reject_direct.c" <<'EOF'
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+ssize_t write(int fd, const void *buffer, size_t count)
+{
+    static ssize_t (*real_write)(int, const void *, size_t);
+    if (real_write == NULL)
+        real_write = (ssize_t (*)(int, const void *, size_t))dlsym(RTLD_NEXT, "write");
+    int flags = fcntl(fd, F_GETFL);
+    if (flags != -1 && (flags & O_DIRECT))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return real_write(fd, buffer, count);
+}
+EOF
+gcc -O2 -pthread "$REPO/safe-cp-v2.c" -o "$TEST_DIR/safe_cp" &&
+    gcc -O2 -shared -fPIC "$TEST_DIR/reject_direct.c" -o "$TEST_DIR/reject_direct.so" -ldl || exit 1
+
+# an unaligned size, so the tail goes through the page cache too
+mkdir -p "$TEST_DIR/source"
+head -c 20000123 /dev/urandom > "$TEST_DIR/source/file" || exit 1
+
+failed=0
+# name|arguments
+CASES='default|
+verify|--verify
+read_write|--engine=read_write
+splice|--engine=splice'
+echo "$CASES" | while IFS='|' read -r name arguments; do
+    rm -rf "$TEST_DIR/destination"
+    # shellcheck disable=SC2086
+    LD_PRELOAD="$TEST_DIR/reject_direct.so" "$TEST_DIR/safe_cp" --direct=1 $arguments \
+        -s "$TEST_DIR/source/file" -d "$TEST_DIR/destination" < /dev/null > "$TEST_DIR/output.txt"
+    status=$?
+    if [ $status -eq 0 ] && cmp -s "$TEST_DIR/source/file" "$TEST_DIR/destination/file"; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name (exit $status)"
+        cat "$TEST_DIR/output.txt"
+        exit 1
+    fi
+done || failed=1
+exit $failed